@@ -0,0 +1,625 @@
+/*
+ * Memory pool benchmark.
+ *
+ * Author: ForeverCai <gdzhforever@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "mempool.h"
+#include "bench.h"
+
+#define ALIGN_UP(size, align)	(((size)+(align)-1)&(~((align)-1)))
+
+/*
+ * 延时直方图: 每个2的幂区间再等分16份, 精度约6%
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(HIST_SUB * 40)
+
+struct bench_hist {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t total;
+};
+
+static inline uint32_t hist_index(uint64_t ns)
+{
+	uint32_t e, idx;
+
+	if (ns < HIST_SUB)
+		return ns;
+	e = 63 - __builtin_clzll(ns);
+	idx = (e - HIST_SUB_BITS + 1) * HIST_SUB + ((ns >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+	return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_value(uint32_t idx)
+{
+	uint32_t e;
+
+	if (idx < HIST_SUB)
+		return idx;
+	e = idx / HIST_SUB + HIST_SUB_BITS - 1;
+	return ((uint64_t)(HIST_SUB + idx % HIST_SUB)) << (e - HIST_SUB_BITS);
+}
+
+static inline void hist_add(struct bench_hist *h, uint64_t ns)
+{
+	h->count[hist_index(ns)]++;
+	h->total++;
+}
+
+static void hist_merge(struct bench_hist *dst, struct bench_hist *src)
+{
+	uint32_t i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->count[i] += src->count[i];
+	dst->total += src->total;
+}
+
+static uint64_t hist_percentile(struct bench_hist *h, double p)
+{
+	uint64_t want = (uint64_t)(h->total * p), sum = 0;
+	uint32_t i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += h->count[i];
+		if (sum > want)
+			return hist_value(i);
+	}
+	return hist_value(HIST_BUCKETS - 1);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t xorshift32(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/*
+ * 被测分配器
+ */
+struct bench_alloc {
+	const char *name;
+	uint32_t type;
+	void *pool;
+	void *(*alloc)(void *pool, uint32_t size);
+	void (*free)(void *pool, void *objp);
+};
+
+static void *smem_alloc(void *pool, uint32_t size)
+{
+	return smempool_alloc(pool);
+}
+
+static void smem_free(void *pool, void *objp)
+{
+	smempool_free(pool, objp);
+}
+
+static void *mmem_alloc(void *pool, uint32_t size)
+{
+	return mmempool_alloc(pool, size);
+}
+
+static void mmem_free(void *pool, void *objp)
+{
+	mmempool_free(pool, objp);
+}
+
+static void *arena_alloc(void *pool, uint32_t size)
+{
+	return mmempool_arena_alloc(pool, size);
+}
+
+static void arena_free(void *pool, void *objp)
+{
+	mmempool_arena_free(pool, objp);
+}
+
+static void *sys_alloc(void *pool, uint32_t size)
+{
+	return malloc(size);
+}
+
+static void sys_free(void *pool, void *objp)
+{
+	free(objp);
+}
+
+/*
+ * 生产者消费者之间的单生产者单消费者环形队列
+ */
+#define RING_SIZE	4096
+
+struct bench_ring {
+	void *slot[RING_SIZE];
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t done;
+};
+
+struct bench_thread {
+	pthread_t tid;
+	uint32_t id;
+	struct bench_opt *opt;
+	struct bench_alloc *ba;
+	struct bench_ring *ring;
+	struct bench_hist alloc_hist;
+	struct bench_hist free_hist;
+	uint64_t failures;
+	uint32_t started;		/* pthread_create成功, 需要join */
+};
+
+static inline uint32_t bench_size(struct bench_opt *opt, uint32_t *seed)
+{
+	uint32_t lo, hi, size;
+
+	switch (opt->size_dist) {
+		case BENCH_SIZE_UNIFORM:
+			return opt->size_min + xorshift32(seed) % (opt->size_max - opt->size_min + 1);
+		case BENCH_SIZE_POW2:
+			lo = 31 - __builtin_clz(opt->size_min);
+			hi = 31 - __builtin_clz(opt->size_max);
+			size = 1U << (lo + xorshift32(seed) % (hi - lo + 1));
+			size += xorshift32(seed) & (size - 1);
+			if (size < opt->size_min)
+				size = opt->size_min;
+			return size > opt->size_max ? opt->size_max : size;
+		default:
+			return opt->size_min;
+	}
+}
+
+static inline void *bench_do_alloc(struct bench_thread *t, uint32_t size)
+{
+	uint64_t start;
+	void *objp;
+
+	start = now_ns();
+	objp = t->ba->alloc(t->ba->pool, size);
+	hist_add(&t->alloc_hist, now_ns() - start);
+	if (objp)
+		*(volatile char *)objp = (char)size;
+	else
+		t->failures++;
+	return objp;
+}
+
+static inline void bench_do_free(struct bench_thread *t, void *objp)
+{
+	uint64_t start;
+
+	start = now_ns();
+	t->ba->free(t->ba->pool, objp);
+	hist_add(&t->free_hist, now_ns() - start);
+}
+
+/* 混合模式: 每个线程按比例分配/释放自己的对象 */
+static void *bench_mixed(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct bench_opt *opt = t->opt;
+	uint32_t seed = 0x9e3779b9 * (t->id + 1);
+	uint32_t i, j, live = 0;
+	void **slot, *objp;
+
+	slot = (void **)calloc(opt->live, sizeof(void *));
+	if (!slot) {
+		t->failures += opt->ops;
+		return NULL;
+	}
+	for (i = 0; i < opt->ops; i++) {
+		int do_alloc = (xorshift32(&seed) % 100) < opt->alloc_ratio;
+
+		if (live == opt->live)
+			do_alloc = 0;
+		else if (live == 0)
+			do_alloc = 1;
+		if (do_alloc) {
+			objp = bench_do_alloc(t, bench_size(opt, &seed));
+			if (objp)
+				slot[live++] = objp;
+		} else {
+			j = xorshift32(&seed) % live;
+			objp = slot[j];
+			slot[j] = slot[--live];
+			bench_do_free(t, objp);
+		}
+	}
+	while (live)
+		t->ba->free(t->ba->pool, slot[--live]);
+	free(slot);
+	return NULL;
+}
+
+/* 生产者: 分配后交给配对的消费者释放 */
+static void *bench_producer(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct bench_ring *ring = t->ring;
+	uint32_t seed = 0x9e3779b9 * (t->id + 1);
+	uint32_t i, head;
+	void *objp;
+
+	for (i = 0; i < t->opt->ops; i++) {
+		objp = bench_do_alloc(t, bench_size(t->opt, &seed));
+		if (!objp) {
+			sched_yield();
+			continue;
+		}
+		head = ring->head;
+		while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+			sched_yield();
+		ring->slot[head % RING_SIZE] = objp;
+		__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&ring->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void *bench_consumer(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct bench_ring *ring = t->ring;
+	uint32_t tail = 0;
+
+	for (;;) {
+		if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) &&
+			    tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+				break;
+			sched_yield();
+			continue;
+		}
+		bench_do_free(t, ring->slot[tail % RING_SIZE]);
+		__atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* 最大chunk 1G, order2bytes()为int, 2G的chunk会溢出 */
+#define BENCH_ORDER_MAX		20
+
+static int bench_pool_create(struct bench_opt *opt, struct bench_alloc *ba)
+{
+	uint64_t mem_size;
+	uint32_t order_max;
+
+	switch (ba->type) {
+		case BENCH_ALLOC_SMEM:
+			mem_size = (uint64_t)opt->threads * (opt->prod_cons ? RING_SIZE + 64 : opt->live)
+				* (ALIGN_UP(opt->size_max, 16) + sizeof(smem_bufctl_t)) + 4096;
+			if (mem_size > UINT32_MAX)
+				return -1;
+			ba->pool = smempool_create_ex(NULL, mem_size, opt->size_max, 0, opt->pool_flags);
+			break;
+		case BENCH_ALLOC_MMEM:
+			mem_size = (uint64_t)opt->mem_mb << 20;
+			if (!opt->mem_mb || mem_size > UINT32_MAX)
+				return -1;
+			order_max = 63 - __builtin_clzll(mem_size >> 10);
+			if (order_max > BENCH_ORDER_MAX)
+				order_max = BENCH_ORDER_MAX;
+			ba->pool = mmempool_create_ex(NULL, mem_size, 0, order_max, opt->pool_flags);
+			break;
+		case BENCH_ALLOC_ARENA:
+			mem_size = (uint64_t)opt->mem_mb << 20;
+			/* 每个分片至少1K */
+			if (mem_size > UINT32_MAX || (mem_size / opt->threads) >> 10 == 0)
+				return -1;
+			order_max = 63 - __builtin_clzll((mem_size / opt->threads) >> 10);
+			if (order_max > BENCH_ORDER_MAX)
+				order_max = BENCH_ORDER_MAX;
+			ba->pool = mmempool_arena_create(NULL, mem_size, 0, order_max, opt->threads, opt->pool_flags);
+			break;
+		default:
+			ba->pool = NULL;
+			return 0;
+	}
+	return ba->pool ? 0 : -1;
+}
+
+static void bench_pool_destroy(struct bench_alloc *ba)
+{
+	if (ba->type == BENCH_ALLOC_SMEM)
+		smempool_destroy(ba->pool);
+	else if (ba->type == BENCH_ALLOC_MMEM)
+		mmempool_destroy(ba->pool);
+	else if (ba->type == BENCH_ALLOC_ARENA)
+		mmempool_arena_destroy(ba->pool);
+}
+
+static void bench_run(struct bench_opt *opt, struct bench_alloc *ba)
+{
+	struct bench_thread *t;
+	struct bench_ring *ring = NULL;
+	struct bench_hist alloc_hist, free_hist;
+	uint64_t start, elapsed, ops, failures = 0;
+	uint32_t i, nr;
+	int err;
+
+	if (bench_pool_create(opt, ba) < 0) {
+		printf("%-8s create failed\n", ba->name);
+		return;
+	}
+	t = (struct bench_thread *)calloc(opt->threads, sizeof(*t));
+	if (opt->prod_cons)
+		ring = (struct bench_ring *)calloc(opt->threads / 2, sizeof(*ring));
+	if (!t || (opt->prod_cons && !ring)) {
+		printf("%-8s out of memory\n", ba->name);
+		goto out;
+	}
+	start = now_ns();
+	for (nr = 0; nr < opt->threads; nr++) {
+		t[nr].id = nr;
+		t[nr].opt = opt;
+		t[nr].ba = ba;
+		if (opt->prod_cons) {
+			t[nr].ring = &ring[nr / 2];
+			err = pthread_create(&t[nr].tid, NULL, (nr & 1) ? bench_consumer : bench_producer, &t[nr]);
+		} else
+			err = pthread_create(&t[nr].tid, NULL, bench_mixed, &t[nr]);
+		if (err) {
+			printf("%-8s pthread_create failed, running %u of %u threads\n", ba->name, nr, opt->threads);
+			/* 已经启动的生产者需要配对的消费者, 在本线程中消费 */
+			if (opt->prod_cons && (nr & 1))
+				bench_consumer(&t[nr++]);
+			break;
+		}
+		t[nr].started = 1;
+	}
+	memset(&alloc_hist, 0, sizeof(alloc_hist));
+	memset(&free_hist, 0, sizeof(free_hist));
+	for (i = 0; i < nr; i++) {
+		if (t[i].started)
+			pthread_join(t[i].tid, NULL);
+		hist_merge(&alloc_hist, &t[i].alloc_hist);
+		hist_merge(&free_hist, &t[i].free_hist);
+		failures += t[i].failures;
+	}
+	elapsed = now_ns() - start;
+	ops = alloc_hist.total + free_hist.total;
+
+	printf("%-8s %10.3f %8llu %8llu %8llu %8llu %8llu %8llu %10llu\n", ba->name,
+		ops * 1000.0 / elapsed,
+		(unsigned long long)hist_percentile(&alloc_hist, 0.50),
+		(unsigned long long)hist_percentile(&alloc_hist, 0.99),
+		(unsigned long long)hist_percentile(&alloc_hist, 0.999),
+		(unsigned long long)hist_percentile(&free_hist, 0.50),
+		(unsigned long long)hist_percentile(&free_hist, 0.99),
+		(unsigned long long)hist_percentile(&free_hist, 0.999),
+		(unsigned long long)failures);
+out:
+	free(ring);
+	free(t);
+	bench_pool_destroy(ba);
+}
+
+void bench_opt_init(struct bench_opt *opt)
+{
+	memset(opt, 0, sizeof(*opt));
+	opt->threads = 4;
+	opt->ops = 1000000;
+	opt->live = 1024;
+	opt->size_dist = BENCH_SIZE_FIXED;
+	opt->size_min = 64;
+	opt->size_max = 64;
+	opt->alloc_ratio = 50;
+	opt->allocators = BENCH_ALLOC_SMEM | BENCH_ALLOC_MMEM | BENCH_ALLOC_MALLOC;
+	opt->mem_mb = 256;
+}
+
+/*
+ * fixed:N, uniform:MIN-MAX, pow2:MIN-MAX
+ */
+int bench_parse_size(struct bench_opt *opt, const char *arg)
+{
+	unsigned int lo, hi;
+
+	if (sscanf(arg, "fixed:%u", &lo) == 1) {
+		opt->size_dist = BENCH_SIZE_FIXED;
+		hi = lo;
+	} else if (sscanf(arg, "uniform:%u-%u", &lo, &hi) == 2) {
+		opt->size_dist = BENCH_SIZE_UNIFORM;
+	} else if (sscanf(arg, "pow2:%u-%u", &lo, &hi) == 2) {
+		opt->size_dist = BENCH_SIZE_POW2;
+	} else
+		return -1;
+	if (lo == 0 || hi < lo)
+		return -1;
+	opt->size_min = lo;
+	opt->size_max = hi;
+	return 0;
+}
+
+/*
+ * 逗号分隔: smem,mmem,arena,malloc, 有不认识的名字时返回-1
+ */
+int bench_parse_allocators(struct bench_opt *opt, const char *arg)
+{
+	static const struct {
+		const char *name;
+		uint32_t type;
+	} names[] = {
+		{"smem", BENCH_ALLOC_SMEM},
+		{"mmem", BENCH_ALLOC_MMEM},
+		{"arena", BENCH_ALLOC_ARENA},
+		{"malloc", BENCH_ALLOC_MALLOC},
+	};
+	uint32_t allocators = 0, i;
+	const char *end;
+	size_t len;
+
+	for (;;) {
+		end = strchr(arg, ',');
+		len = end ? (size_t)(end - arg) : strlen(arg);
+		for (i = 0; i < sizeof(names)/sizeof(names[0]); i++) {
+			if (strlen(names[i].name) == len && !strncmp(arg, names[i].name, len))
+				break;
+		}
+		if (i == sizeof(names)/sizeof(names[0])) {
+			printf("unknown allocator '%.*s'\n", (int)len, arg);
+			return -1;
+		}
+		allocators |= names[i].type;
+		if (!end)
+			break;
+		arg = end + 1;
+	}
+	opt->allocators = allocators;
+	return 0;
+}
+
+void mempool_bench(struct bench_opt *opt)
+{
+	struct bench_alloc allocs[] = {
+		{"smempool", BENCH_ALLOC_SMEM, NULL, smem_alloc, smem_free},
+		{"mmempool", BENCH_ALLOC_MMEM, NULL, mmem_alloc, mmem_free},
+		{"arena", BENCH_ALLOC_ARENA, NULL, arena_alloc, arena_free},
+		{"malloc", BENCH_ALLOC_MALLOC, NULL, sys_alloc, sys_free},
+	};
+	uint32_t i;
+
+	if (!opt->threads || !opt->live) {
+		printf("threads and live must be at least 1\n");
+		return;
+	}
+	if (opt->prod_cons && opt->threads < 2)
+		opt->threads = 2;
+	if (opt->prod_cons)
+		opt->threads &= ~1U;
+	printf("threads=%u ops/thread=%u live=%u size=%u-%u dist=%u alloc=%u%% %s flags=0x%x\n",
+		opt->threads, opt->ops, opt->live, opt->size_min, opt->size_max,
+		opt->size_dist, opt->alloc_ratio,
+		opt->prod_cons ? "producer/consumer" : "mixed", opt->pool_flags);
+	printf("%-8s %10s %8s %8s %8s %8s %8s %8s %10s\n", "",
+		"Mops/s", "a-p50", "a-p99", "a-p999", "f-p50", "f-p99", "f-p999", "failures");
+	for (i = 0; i < sizeof(allocs)/sizeof(allocs[0]); i++) {
+		if (opt->allocators & allocs[i].type)
+			bench_run(opt, &allocs[i]);
+	}
+	printf("(latency in ns)\n");
+}
+
+/*
+ * 伪共享: 主线程依次从同一个smempool分配每线程一个对象(如每连接结构体),
+ * 各线程反复写自己的对象. 对象共享cacheline时写操作在核间来回失效.
+ * 分别测试pool_flags与pool_flags|MEMPOOL_F_HWCACHE_ALIGN.
+ */
+struct fs_thread {
+	pthread_t tid;
+	volatile uint64_t *counter;
+	uint32_t ops;
+	uint32_t *start;
+};
+
+static void *fs_worker(void *arg)
+{
+	struct fs_thread *t = arg;
+	uint32_t i;
+
+	while (!__atomic_load_n(t->start, __ATOMIC_ACQUIRE))
+		sched_yield();
+	for (i = 0; i < t->ops; i++)
+		(*t->counter)++;
+	return NULL;
+}
+
+static void false_share_run(struct bench_opt *opt, uint32_t flags)
+{
+	struct fs_thread *t;
+	smempool_t *pool;
+	uint64_t start_ns, elapsed;
+	uint32_t i, j, nr, start = 0, shared = 0;
+	uint32_t size = opt->size_min < sizeof(uint64_t) ? sizeof(uint64_t) : opt->size_min;
+
+	pool = smempool_create_ex(NULL, opt->threads * (ALIGN_UP(size, MEMPOOL_CACHE_LINE) + 64) + 4096,
+			size, 0, flags);
+	if (!pool) {
+		printf("flags=0x%-8x create failed\n", flags);
+		return;
+	}
+	t = (struct fs_thread *)calloc(opt->threads, sizeof(*t));
+	if (!t) {
+		printf("flags=0x%-8x out of memory\n", flags);
+		smempool_destroy(pool);
+		return;
+	}
+	for (i = 0; i < opt->threads; i++) {
+		t[i].counter = smempool_alloc(pool);
+		if (!t[i].counter) {
+			printf("flags=0x%-8x alloc failed\n", flags);
+			goto out;
+		}
+		*t[i].counter = 0;
+		t[i].ops = opt->ops;
+		t[i].start = &start;
+	}
+	/* 与其他线程的对象共享cacheline的对象个数 */
+	for (i = 0; i < opt->threads; i++) {
+		for (j = 0; j < opt->threads; j++) {
+			if (i != j && ((uintptr_t)t[i].counter / MEMPOOL_CACHE_LINE ==
+				       (uintptr_t)t[j].counter / MEMPOOL_CACHE_LINE ||
+				       ((uintptr_t)t[i].counter + size - 1) / MEMPOOL_CACHE_LINE ==
+				       (uintptr_t)t[j].counter / MEMPOOL_CACHE_LINE)) {
+				shared++;
+				break;
+			}
+		}
+	}
+	for (nr = 0; nr < opt->threads; nr++) {
+		if (pthread_create(&t[nr].tid, NULL, fs_worker, &t[nr]))
+			break;
+	}
+	start_ns = now_ns();
+	__atomic_store_n(&start, 1, __ATOMIC_RELEASE);
+	for (j = 0; j < nr; j++)
+		pthread_join(t[j].tid, NULL);
+	elapsed = now_ns() - start_ns;
+
+	if (nr < opt->threads)
+		printf("flags=0x%-8x pthread_create failed, %u of %u threads\n", flags, nr, opt->threads);
+	else
+		printf("flags=0x%-8x stride=%-5u shared=%u/%u %8.3f ns/write\n", flags, pool->ele_asize,
+			shared, opt->threads, (double)elapsed / opt->ops);
+out:
+	for (j = 0; j < i; j++)
+		smempool_free(pool, (void *)t[j].counter);
+	free(t);
+	smempool_destroy(pool);
+}
+
+void mempool_false_share_bench(struct bench_opt *opt)
+{
+	printf("false sharing: threads=%u writes/thread=%u size=%u\n",
+		opt->threads, opt->ops, opt->size_min);
+	false_share_run(opt, opt->pool_flags);
+	false_share_run(opt, opt->pool_flags | MEMPOOL_F_HWCACHE_ALIGN);
+}
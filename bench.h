@@ -0,0 +1,47 @@
+/*
+ * Memory pool benchmark.
+ *
+ * Author: ForeverCai <gdzhforever@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ */
+#ifndef __BENCH_H_
+#define __BENCH_H_
+
+#include <stdint.h>
+
+enum {
+	BENCH_SIZE_FIXED = 0,		/* always size_min */
+	BENCH_SIZE_UNIFORM,		/* uniform in [size_min, size_max] */
+	BENCH_SIZE_POW2,		/* log-uniform in [size_min, size_max] */
+};
+
+#define BENCH_ALLOC_SMEM	0x01
+#define BENCH_ALLOC_MMEM	0x02
+#define BENCH_ALLOC_MALLOC	0x04
+#define BENCH_ALLOC_ARENA	0x08
+
+struct bench_opt {
+	uint32_t threads;
+	uint32_t ops;			/* operations per thread */
+	uint32_t live;			/* max live objects per thread */
+	uint32_t size_dist;
+	uint32_t size_min, size_max;
+	uint32_t alloc_ratio;		/* percent of operations that allocate */
+	uint32_t prod_cons;		/* producers allocate, consumers free */
+	uint32_t allocators;		/* BENCH_ALLOC_* */
+	uint32_t pool_flags;		/* create flags for both pools */
+	uint32_t mem_mb;		/* mmempool / arena size */
+};
+
+void bench_opt_init(struct bench_opt *opt);
+int bench_parse_size(struct bench_opt *opt, const char *arg);
+int bench_parse_allocators(struct bench_opt *opt, const char *arg);
+void mempool_bench(struct bench_opt *opt);
+void mempool_false_share_bench(struct bench_opt *opt);
+
+#endif
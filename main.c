@@ -12,13 +12,22 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <time.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <sys/wait.h>
 
 #include "mempool.h"
+#include "bench.h"
+
+#ifdef MEMPOOL_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
 
 #define KSIZE(n) (n<<10)
 #define MSIZE(n) (n<<20)
@@ -144,6 +153,472 @@ free_all:
 
 }
 
+/*
+ * obj_to_index用倒数乘法代替除法, 对各种元素大小逐字节校验
+ */
+void smempool_index_test(void)
+{
+	static const uint32_t large[] = {3000, 4095, 4097, 65535, 100003, 1048573};
+	smempool_t *mempool;
+	uint32_t size, i, fail = 0, n = 0;
+
+	for (size = 1; size <= 4096; size++, n++) {
+		mempool = smempool_create(NULL, KSIZE(64) + size * 4, size, 1);
+		if (smempool_verify_index(mempool)) {
+			printf("index test failed, element size %u\n", size);
+			fail++;
+		}
+		smempool_destroy(mempool);
+	}
+	for (i = 0; i < sizeof(large)/sizeof(large[0]); i++, n++) {
+		mempool = smempool_create(NULL, MSIZE(4), large[i], 1);
+		if (smempool_verify_index(mempool)) {
+			printf("index test failed, element size %u\n", large[i]);
+			fail++;
+		}
+		smempool_destroy(mempool);
+	}
+	printf("index test: %u element sizes, %u failed\n", n, fail);
+}
+
+/*
+ * mmempool_realloc: 新内存池中第一个块之后都是空闲内存, 增大和缩小都应原地完成;
+ * size class对象在同一类中不移动; 随机realloc时内容保持不变, 全部释放后内存都能收回
+ */
+#define REALLOC_TEST_NUM	128
+#define REALLOC_TEST_ROUNDS	20000
+static int realloc_check(unsigned char *p, uint32_t size, unsigned char c)
+{
+	uint32_t i;
+
+	for (i = 0; i < size && p[i] == c; i++)
+		;
+	return i == size;
+}
+
+void mmempool_realloc_test(void)
+{
+	static const uint32_t flags[] = {0, MEMPOOL_F_BUDDY, MEMPOOL_F_OOB,
+		MEMPOOL_F_SIZE_CLASS, MEMPOOL_F_SIZE_CLASS | MEMPOOL_F_BUDDY};
+	static unsigned char *obj[REALLOC_TEST_NUM];
+	static uint32_t size[REALLOC_TEST_NUM];
+	uint32_t f, i, k, sz, total, fail = 0;
+	unsigned char *p, *q;
+	mmempool_t *mempool;
+
+	srand(1);
+	for (f = 0; f < sizeof(flags)/sizeof(flags[0]); f++) {
+		mempool = mmempool_create_ex(NULL, MSIZE(4), 0, 10, flags[f]);
+		if (!mempool) {
+			printf("realloc test: flags=0x%x create failed\n", flags[f]);
+			fail++;
+			continue;
+		}
+		total = mmempool_remain_size(mempool);
+		p = mmempool_alloc(mempool, 3000);
+		memset(p, 1, 3000);
+		q = mmempool_realloc(mempool, p, 6000);
+		if (q != p || !realloc_check(q, 3000, 1)) {
+			printf("realloc test: flags=0x%x grow not in place\n", flags[f]);
+			fail++;
+		}
+		memset(q, 2, 6000);
+		p = mmempool_realloc(mempool, q, 2000);
+		if (p != q || !realloc_check(p, 2000, 2)) {
+			printf("realloc test: flags=0x%x shrink not in place\n", flags[f]);
+			fail++;
+		}
+		mmempool_free(mempool, p);
+		if (flags[f] & MEMPOOL_F_SIZE_CLASS) {
+			/* 40和60字节同在64字节类中, 200字节换类, 5000字节退回chunk */
+			p = mmempool_alloc(mempool, 40);
+			memset(p, 3, 40);
+			q = mmempool_realloc(mempool, p, 60);
+			if (q != p) {
+				printf("realloc test: flags=0x%x size class object moved\n", flags[f]);
+				fail++;
+			}
+			q = mmempool_realloc(mempool, q, 200);
+			p = q ? mmempool_realloc(mempool, q, 5000) : NULL;
+			if (!q || !p || !realloc_check(p, 40, 3)) {
+				printf("realloc test: flags=0x%x size class routing lost contents\n", flags[f]);
+				fail++;
+			}
+			mmempool_free(mempool, p);
+		}
+		memset(obj, 0, sizeof(obj));
+		for (k = 0; k < REALLOC_TEST_ROUNDS; k++) {
+			i = rand() % REALLOC_TEST_NUM;
+			sz = 1 + rand() % (rand() & 1 ? 500 : 20000);
+			if (obj[i] && !realloc_check(obj[i], size[i], (unsigned char)i)) {
+				printf("realloc test: flags=0x%x object %u corrupted\n", flags[f], i);
+				fail++;
+				break;
+			}
+			p = mmempool_realloc(mempool, obj[i], sz);
+			if (!p)
+				continue;
+			if (obj[i] && !realloc_check(p, size[i] < sz ? size[i] : sz, (unsigned char)i)) {
+				printf("realloc test: flags=0x%x realloc %u->%u lost contents\n", flags[f], size[i], sz);
+				fail++;
+			}
+			memset(p, i, sz);
+			obj[i] = p;
+			size[i] = sz;
+		}
+		for (i = 0; i < REALLOC_TEST_NUM; i++)
+			mmempool_free(mempool, obj[i]);
+		/* size class模式每类保留一个空slab */
+		if (!(flags[f] & MEMPOOL_F_SIZE_CLASS) && mmempool_remain_size(mempool) != total) {
+			printf("realloc test: flags=0x%x remain %u, expect %u\n", flags[f],
+				mmempool_remain_size(mempool), total);
+			fail++;
+		}
+		mmempool_destroy(mempool);
+	}
+	printf("realloc test: %u modes, %u failed\n", (uint32_t)(sizeof(flags)/sizeof(flags[0])), fail);
+}
+
+/*
+ * 注解(make asan): 分配出去的对象在申请大小之内可访问, 之后和释放后都被poison
+ */
+#ifdef MEMPOOL_ASAN
+#define ANNO_CHECK(what, cond) do { \
+		n++; \
+		if (!(cond)) { \
+			printf("anno test: flags=0x%x %s\n", flags[f], what); \
+			fail++; \
+		} \
+	} while (0)
+#define anno_poisoned(p)	__asan_address_is_poisoned(p)
+
+void mempool_anno_test(void)
+{
+	static const uint32_t sflags[] = {0, MEMPOOL_F_MAGAZINE, MEMPOOL_F_LOCKFREE, MEMPOOL_F_GROW, MEMPOOL_F_BITMAP};
+	static const uint32_t mflags[] = {0, MEMPOOL_F_BUDDY, MEMPOOL_F_OOB, MEMPOOL_F_SIZE_CLASS};
+	const uint32_t *flags = sflags;
+	uint32_t f, n = 0, fail = 0;
+	smempool_t *spool;
+	mmempool_t *mpool;
+	char *p, *q;
+
+	/* 24字节元素按16对齐为32字节, 末尾8字节应被poison */
+	for (f = 0; f < sizeof(sflags)/sizeof(sflags[0]); f++) {
+		spool = smempool_create_ex(NULL, KSIZE(64), 24, 16, sflags[f]);
+		p = smempool_alloc(spool);
+		ANNO_CHECK("smempool object not accessible", p && !anno_poisoned(p) && !anno_poisoned(p + 23));
+		ANNO_CHECK("smempool padding not poisoned", p && anno_poisoned(p + 24));
+		smempool_free(spool, p);
+		ANNO_CHECK("smempool freed object not poisoned", p && anno_poisoned(p));
+		smempool_destroy(spool);
+	}
+	flags = mflags;
+	for (f = 0; f < sizeof(mflags)/sizeof(mflags[0]); f++) {
+		mpool = mmempool_create_ex(NULL, MSIZE(1), 0, 6, mflags[f]);
+		p = mmempool_alloc(mpool, 100);
+		ANNO_CHECK("mmempool object not accessible", p && !anno_poisoned(p) && !anno_poisoned(p + 99));
+		ANNO_CHECK("mmempool tail not poisoned", p && anno_poisoned(p + 100));
+		q = mmempool_realloc(mpool, p, 5000);
+		ANNO_CHECK("mmempool realloc size not tracked", q && !anno_poisoned(q + 4999) && anno_poisoned(q + 5000));
+		mmempool_free(mpool, q);
+		ANNO_CHECK("mmempool freed object not poisoned", q && anno_poisoned(q));
+		mmempool_destroy(mpool);
+	}
+	printf("anno test: %u checks, %u failed\n", n, fail);
+}
+#else
+void mempool_anno_test(void)
+{
+	printf("anno test: skipped, build with make asan\n");
+}
+#endif
+
+/*
+ * MEMPOOL_F_SHARED: fork出的子进程接入并分配, 通过管道传回偏移, 父进程检查内容并释放
+ */
+#define SHARED_TEST_NUM		64
+#define SHARED_TEST_SIZE	128
+void smempool_shared_test(void)
+{
+	uint32_t off[SHARED_TEST_NUM];
+	uint32_t i, j, n, fail = 0;
+	smempool_t *mempool, *pool;
+	mempool_stats_t st;
+	int fds[2], status;
+	unsigned char *objp;
+	ssize_t len;
+	pid_t pid;
+
+	mempool = smempool_create_ex(NULL, KSIZE(64), SHARED_TEST_SIZE, 0,
+			MEMPOOL_F_SHARED | MEMPOOL_F_LOCK(MEMPOOL_LOCK_MUTEX));
+	if (!mempool || pipe(fds)) {
+		printf("shared test: create failed\n");
+		smempool_destroy(mempool);
+		return;
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		pool = smempool_attach(mempool, KSIZE(64));
+		for (i = 0; pool && i < SHARED_TEST_NUM; i++) {
+			objp = smempool_alloc(pool);
+			if (!objp)
+				break;
+			memset(objp, i, SHARED_TEST_SIZE);
+			off[i] = smempool_ptr2off(pool, objp);
+		}
+		if (write(fds[1], off, i * sizeof(off[0])) < 0)
+			i = 0;
+		/* 子进程不能销毁共享内存池 */
+		smempool_destroy(pool);
+		if (smempool_detach(pool))
+			i = 0;
+		_exit(i == SHARED_TEST_NUM ? 0 : 1);
+	}
+	close(fds[1]);
+	n = 0;
+	while (pid > 0 && (len = read(fds[0], (char *)off + n, sizeof(off) - n)) > 0)
+		n += len;
+	close(fds[0]);
+	n /= sizeof(off[0]);
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		printf("shared test: child failed\n");
+		fail++;
+	}
+	smempool_get_stats(mempool, &st);
+	if (st.inuse != n || __atomic_load_n(&mempool->magic, __ATOMIC_RELAXED) == 0) {
+		printf("shared test: inuse=%u, expect %u\n", (uint32_t)st.inuse, n);
+		fail++;
+	}
+	for (i = 0; i < n; i++) {
+		objp = smempool_off2ptr(mempool, off[i]);
+		for (j = 0; j < SHARED_TEST_SIZE && objp[j] == (unsigned char)i; j++)
+			;
+		if (j != SHARED_TEST_SIZE) {
+			printf("shared test: object %u corrupted\n", i);
+			fail++;
+		}
+		smempool_free(mempool, objp);
+	}
+	smempool_get_stats(mempool, &st);
+	if (st.inuse) {
+		printf("shared test: inuse=%u after free\n", (uint32_t)st.inuse);
+		fail++;
+	}
+	printf("shared test: %u objects from child, %u failed\n", n, fail);
+	smempool_destroy(mempool);
+}
+
+/*
+ * MEMPOOL_F_REMOTE_FREE: 主线程(owner)分配, 其他线程逐个和成批释放,
+ * owner的统计在取回remote栈后归零, 非owner线程不能分配
+ */
+#define REMOTE_TEST_THREADS	4
+#define REMOTE_TEST_NUM		1024
+struct remote_test_arg {
+	smempool_t *mempool;
+	void **objs;
+	uint32_t n;
+	void *alloc;
+	int started;
+};
+
+static void *remote_test_thread(void *data)
+{
+	struct remote_test_arg *arg = data;
+	uint32_t half = arg->n / 2, i;
+
+	for (i = 0; i < half; i++)
+		smempool_free(arg->mempool, arg->objs[i]);
+	smempool_free_bulk(arg->mempool, arg->objs + half, arg->n - half);
+	arg->alloc = smempool_alloc(arg->mempool);
+	return NULL;
+}
+
+void smempool_remote_test(void)
+{
+	struct remote_test_arg arg[REMOTE_TEST_THREADS];
+	pthread_t tid[REMOTE_TEST_THREADS];
+	static void *objs[REMOTE_TEST_NUM];
+	uint32_t i, n, per, fail = 0;
+	smempool_t *mempool;
+	mempool_stats_t st;
+
+	mempool = smempool_create_ex(NULL, MSIZE(1), 64, 0, MEMPOOL_F_REMOTE_FREE | MEMPOOL_F_STATS);
+	if (!mempool) {
+		printf("remote test: create failed\n");
+		return;
+	}
+	n = smempool_alloc_bulk(mempool, objs, REMOTE_TEST_NUM);
+	per = n / REMOTE_TEST_THREADS;
+	for (i = 0; i < REMOTE_TEST_THREADS; i++) {
+		arg[i].mempool = mempool;
+		arg[i].objs = objs + i * per;
+		arg[i].n = (i == REMOTE_TEST_THREADS - 1) ? n - i * per : per;
+		arg[i].alloc = NULL;
+		arg[i].started = !pthread_create(&tid[i], NULL, remote_test_thread, &arg[i]);
+		if (!arg[i].started) {
+			printf("remote test: pthread_create failed\n");
+			remote_test_thread(&arg[i]);
+			fail++;
+		}
+	}
+	for (i = 0; i < REMOTE_TEST_THREADS; i++) {
+		if (arg[i].started)
+			pthread_join(tid[i], NULL);
+		if (arg[i].alloc) {
+			printf("remote test: thread %u allocated from a non-owner thread\n", i);
+			fail++;
+		}
+	}
+	smempool_get_stats(mempool, &st);
+	if (st.inuse || st.frees != n) {
+		printf("remote test: inuse=%u frees=%u, expect 0 and %u\n", (uint32_t)st.inuse, (uint32_t)st.frees, n);
+		fail++;
+	}
+	/* 取回的元素可以全部重新分配 */
+	if (smempool_alloc_bulk(mempool, objs, n) != n) {
+		printf("remote test: remote frees not reusable\n");
+		fail++;
+	}
+	printf("remote test: %u objects freed by %u threads, %u failed\n", n, REMOTE_TEST_THREADS, fail);
+	smempool_destroy(mempool);
+}
+
+/*
+ * LD_PRELOAD: 带上libmempool_preload.so重新执行自己, 检查malloc系列接口,
+ * 以及其他线程分配时fork出的子进程仍能分配(见pl_atfork_prepare)
+ */
+#define PRELOAD_LIB		"./libmempool_preload.so"
+#define PRELOAD_THREADS		4
+#define PRELOAD_FORKS		50
+static volatile int preload_stop;
+
+static void *preload_thread(void *data)
+{
+	uint32_t seed = (uint32_t)(uintptr_t)data, i;
+	void *v[64] = {0};
+
+	while (!preload_stop) {
+		seed = seed * 1103515245 + 12345;
+		i = (seed >> 4) % 64;
+		free(v[i]);
+		v[i] = malloc((seed >> 12) % 20000);
+	}
+	for (i = 0; i < 64; i++)
+		free(v[i]);
+	return NULL;
+}
+
+static uint32_t preload_check_fork(void)
+{
+	pthread_t tid[PRELOAD_THREADS];
+	uint32_t i, k, fail = 0, started = 0;
+	int status;
+	pid_t pid;
+
+	preload_stop = 0;
+	for (i = 0; i < PRELOAD_THREADS; i++)
+		if (!pthread_create(&tid[started], NULL, preload_thread, (void *)(uintptr_t)(i + 1)))
+			started++;
+	for (i = 0; i < PRELOAD_FORKS; i++) {
+		pid = fork();
+		if (pid == 0) {
+			/* 锁停在fork前的状态时子进程会卡住 */
+			alarm(10);
+			for (k = 0; k < 10000; k++)
+				free(malloc(k * 7 % 20000));
+			_exit(0);
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+			fail++;
+	}
+	preload_stop = 1;
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+	if (fail)
+		printf("preload test: %u of %u forked children failed\n", fail, PRELOAD_FORKS);
+	return fail ? 1 : 0;
+}
+
+void preload_test(void)
+{
+	static const size_t sizes[] = {0, 1, 16, 1008, 1009, 4096, 100000, 3 << 20};
+	const char *env = getenv("LD_PRELOAD");
+	uint32_t i, n = 0, fail = 0;
+	unsigned char *p, *q;
+	void *a;
+
+	if (!env || !strstr(env, "libmempool_preload")) {
+		if (access(PRELOAD_LIB, R_OK)) {
+			printf("preload test: %s not found, run make preload\n", PRELOAD_LIB);
+			return;
+		}
+		fflush(stdout);
+		setenv("LD_PRELOAD", PRELOAD_LIB, 1);
+		execl("/proc/self/exe", "memorypool", "-P", (char *)NULL);
+		printf("preload test: exec failed\n");
+		return;
+	}
+	/* 预加载库在每个分配前放16字节头部, 最后4字节高12位为魔数 */
+	p = malloc(100);
+	n++;
+	if (!p || (*(uint32_t *)((uintptr_t)p - sizeof(uint32_t)) & 0xfff00000U) != 0x4d500000U) {
+		printf("preload test: malloc not served by %s\n", PRELOAD_LIB);
+		fail++;
+	}
+	free(p);
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++, n++) {
+		p = malloc(sizes[i]);
+		if (!p || malloc_usable_size(p) < sizes[i]) {
+			printf("preload test: malloc(%zu) failed\n", sizes[i]);
+			fail++;
+			continue;
+		}
+		memset(p, 0xa5, sizes[i]);
+		free(p);
+	}
+	n++;
+	p = malloc(3000);
+	memset(p, 0xa5, 3000);
+	free(p);
+	p = calloc(3000, 1);
+	for (i = 0; p && i < 3000 && !p[i]; i++)
+		;
+	if (i != 3000) {
+		printf("preload test: calloc memory not zeroed\n");
+		fail++;
+	}
+	free(p);
+	/* realloc跨过smempool, arena和mmap, 内容保持不变 */
+	n++;
+	p = malloc(100);
+	for (i = 0; p && i < 100; i++)
+		p[i] = i;
+	for (i = 0; p && i < 4; i++) {
+		q = realloc(p, (size_t[]){5000, 300000, 3 << 20, 50}[i]);
+		if (!q)
+			break;
+		p = q;
+	}
+	for (i = 0; p && i < 50 && p[i] == i; i++)
+		;
+	if (i != 50) {
+		printf("preload test: realloc lost contents\n");
+		fail++;
+	}
+	free(p);
+	n++;
+	if (posix_memalign(&a, 4096, 5000) || ((uintptr_t)a & 4095)) {
+		printf("preload test: posix_memalign failed\n");
+		fail++;
+	} else
+		free(a);
+	n++;
+	fail += preload_check_fork();
+	printf("preload test: %u checks, %u failed\n", n, fail);
+}
+
 void display_usage(void)
 {
 	printf( "\n"
@@ -152,7 +627,24 @@ void display_usage(void)
 		"Options:\n"
 		"-s --smem      Single Memory Pool Demo.\n"
 		"-m --mmem      Multiple Memory Pool Demo.\n"
-		"-t --thread    Multiple thread test.\n\n"
+		"-t --thread    Multiple thread test.\n"
+		"-i --index     Check smempool element index for every offset.\n"
+		"-S --shared    Check a shared smempool across fork.\n"
+		"-R --remote    Check remote frees from non-owner threads.\n"
+		"-x --realloc   Check in-place mmempool_realloc and size class routing.\n"
+		"-A --anno      Check ASan poisoning of pool objects (make asan).\n"
+		"-P --preload   Check libmempool_preload.so (run make preload first).\n"
+		"-F --false-share  False sharing test, size/threads/ops/flags as below.\n"
+		"Multiple thread test options:\n"
+		"-n --threads   Number of threads (default 4).\n"
+		"-o --ops       Operations per thread (default 1000000).\n"
+		"-l --live      Max live objects per thread (default 1024).\n"
+		"-z --size      Size distribution: fixed:N, uniform:MIN-MAX, pow2:MIN-MAX.\n"
+		"-r --ratio     Percent of operations that allocate, 0-100 (default 50).\n"
+		"-p --pc        Producer/consumer: even threads allocate, odd threads free.\n"
+		"-a --alloc     Allocators to compare: smem,mmem,arena,malloc (default smem,mmem,malloc).\n"
+		"-f --flags     Pool create flags (MEMPOOL_F_*).\n"
+		"-M --mem       mmempool/arena size in MB, 1-4095 (default 256).\n\n"
 		);
 	exit(0);
 }
@@ -164,15 +656,45 @@ void display_version(void)
 	exit(0);
 }
 
+/* 数值选项, 不是min..max之间的整数时显示用法并退出 */
+static uint32_t parse_uint(const char *arg, uint32_t min, uint32_t max)
+{
+	unsigned long long v;
+	char *end;
+
+	errno = 0;
+	v = strtoull(arg, &end, 0);
+	if (errno || end == arg || *end || arg[0] == '-' || v < min || v > max)
+		display_usage();
+	return (uint32_t)v;
+}
+
 int main(int argc, char *argv[])
 {
 	int option_index = 0,c;
-	int smem = 0, mmem = 0;
-	const char *short_options = "smtd:vh";
+	int smem = 0, mmem = 0, thread = 0, index = 0, false_share = 0, shared = 0, remote = 0, preload = 0, resize = 0, anno = 0;
+	struct bench_opt bench;
+	const char *short_options = "smtiSRPxAFn:o:l:z:r:pa:f:M:d:vh";
 	const struct option long_options[] = {
 		{"smem", no_argument, 0, 's'},
 		{"mmem", no_argument, 0, 'm'},
 		{"thread", no_argument, 0, 't'},
+		{"index", no_argument, 0, 'i'},
+		{"shared", no_argument, 0, 'S'},
+		{"remote", no_argument, 0, 'R'},
+		{"preload", no_argument, 0, 'P'},
+		{"realloc", no_argument, 0, 'x'},
+		{"anno", no_argument, 0, 'A'},
+		{"false-share", no_argument, 0, 'F'},
+		{"threads", required_argument, 0, 'n'},
+		{"ops", required_argument, 0, 'o'},
+		{"live", required_argument, 0, 'l'},
+		{"size", required_argument, 0, 'z'},
+		{"ratio", required_argument, 0, 'r'},
+		{"pc", no_argument, 0, 'p'},
+		{"alloc", required_argument, 0, 'a'},
+		{"flags", required_argument, 0, 'f'},
+		{"mem", required_argument, 0, 'M'},
 		{"debug", required_argument, 0, 'd'},
 		{"help", no_argument, 0, 'h'},
 		{"version", no_argument, 0, 'v'},
@@ -181,6 +703,7 @@ int main(int argc, char *argv[])
 
 	if (argc == 1)
 		display_usage();
+	bench_opt_init(&bench);
 
 	for (;;) {
 		c = getopt_long(argc, argv, short_options, long_options, &option_index);
@@ -195,6 +718,58 @@ int main(int argc, char *argv[])
 				mmem = 1;
 				break;
 			case 't':
+				thread = 1;
+				break;
+			case 'i':
+				index = 1;
+				break;
+			case 'S':
+				shared = 1;
+				break;
+			case 'R':
+				remote = 1;
+				break;
+			case 'P':
+				preload = 1;
+				break;
+			case 'x':
+				resize = 1;
+				break;
+			case 'A':
+				anno = 1;
+				break;
+			case 'F':
+				false_share = 1;
+				break;
+			case 'n':
+				bench.threads = parse_uint(optarg, 1, INT32_MAX);
+				break;
+			case 'o':
+				bench.ops = parse_uint(optarg, 1, UINT32_MAX);
+				break;
+			case 'l':
+				bench.live = parse_uint(optarg, 1, INT32_MAX);
+				break;
+			case 'z':
+				if (bench_parse_size(&bench, optarg) < 0)
+					display_usage();
+				break;
+			case 'r':
+				bench.alloc_ratio = parse_uint(optarg, 0, 100);
+				break;
+			case 'p':
+				bench.prod_cons = 1;
+				break;
+			case 'a':
+				if (bench_parse_allocators(&bench, optarg) < 0)
+					display_usage();
+				break;
+			case 'f':
+				bench.pool_flags = strtoul(optarg, NULL, 0);
+				break;
+			case 'M':
+				/* mmempool的mem_size为32位 */
+				bench.mem_mb = parse_uint(optarg, 1, 4095);
 				break;
 			case 'd':
 				mempool_set_debug_level(atoi(optarg));
@@ -214,6 +789,23 @@ int main(int argc, char *argv[])
 		smempool_test();
 	if (mmem)
 		mmempool_test();
+	if (index)
+		smempool_index_test();
+	if (shared)
+		smempool_shared_test();
+	if (remote)
+		smempool_remote_test();
+	if (resize)
+		mmempool_realloc_test();
+	if (anno)
+		mempool_anno_test();
+	if (thread)
+		mempool_bench(&bench);
+	if (false_share)
+		mempool_false_share_bench(&bench);
+	/* 带LD_PRELOAD重新执行自己, 放在最后 */
+	if (preload)
+		preload_test();
 
 	return 0;
 }
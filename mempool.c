@@ -9,6 +9,7 @@
  * the License, or (at your option) any later version.
  *
  */
+#define _GNU_SOURCE
 #include "mempool.h"
 
 #include <stdio.h>
@@ -16,6 +17,13 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 static int debug = 0;
 
@@ -80,288 +88,2553 @@ static int debug = 0;
 #define Debug(fmt, args...)
 #define dbg(fmt, args...)
 
-#define pr_debug(fmt,args...)
-#define pr_info(fmt,args...)
-#define pr_wrn(fmt,args...)
-#define pr_ver(fmt,args...)
-#define pr_emerg(fmt,args...)
+/* 同kernel的no_printk: 不输出, 但参数仍被检查和引用 */
+#define no_printf(fmt,args...)	do { if (0) printf(fmt, ##args); } while (0)
+
+#define pr_debug(fmt,args...)	no_printf(fmt, ##args)
+#define pr_info(fmt,args...)	no_printf(fmt, ##args)
+#define pr_wrn(fmt,args...)	no_printf(fmt, ##args)
+#define pr_ver(fmt,args...)	no_printf(fmt, ##args)
+#define pr_emerg(fmt,args...)	no_printf(fmt, ##args)
 #endif
 
 #define ALIGN_SIZE	16
 #define ALIGN_MASK	(~(ALIGN_SIZE-1))
 #define ALIGN(size, align)	(((size)+align-1)&(~(align-1)))
 
+#define min_t(type, x, y)	((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+
 void mempool_set_debug_level(int level)
 {
 	debug = level;
 }
 
-static inline smem_bufctl_t *smem_bufctl(smempool_t *smem)
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax()	__builtin_ia32_pause()
+#else
+#define cpu_relax()	__asm__ __volatile__("" ::: "memory")
+#endif
+
+/*
+ * 锁后端: 由创建标志 MEMPOOL_F_LOCK(type) 选择
+ */
+static void mempool_lock_init(mempool_lock_t *lock, uint32_t type, int pshared)
 {
-	return (smem_bufctl_t *)(smem+1);
+	pthread_mutexattr_t attr;
+
+	lock->type = type;
+	switch (type) {
+		case MEMPOOL_LOCK_SPIN:
+			pthread_spin_init(&lock->spin, pshared ? PTHREAD_PROCESS_SHARED : PTHREAD_PROCESS_PRIVATE);
+			break;
+		case MEMPOOL_LOCK_MUTEX:
+			pthread_mutexattr_init(&attr);
+#ifdef __GLIBC__
+			pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+#endif
+			if (pshared)
+				pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+			pthread_mutex_init(&lock->mutex, &attr);
+			pthread_mutexattr_destroy(&attr);
+			break;
+		case MEMPOOL_LOCK_TICKET:
+			lock->ticket.next = 0;
+			lock->ticket.owner = 0;
+			break;
+		case MEMPOOL_LOCK_NONE:
+			break;
+		case MEMPOOL_LOCK_SEM:
+		default:
+			lock->type = MEMPOOL_LOCK_SEM;
+			sem_init(&lock->sem, !!pshared, 1);
+			break;
+	}
 }
 
-static inline void *index_to_obj(smempool_t *mempool, uint32_t idx)
+static void mempool_lock_destroy(mempool_lock_t *lock)
 {
-	return mempool->smem + mempool->ele_asize * idx;
+	switch (lock->type) {
+		case MEMPOOL_LOCK_SEM:
+			sem_destroy(&lock->sem);
+			break;
+		case MEMPOOL_LOCK_SPIN:
+			pthread_spin_destroy(&lock->spin);
+			break;
+		case MEMPOOL_LOCK_MUTEX:
+			pthread_mutex_destroy(&lock->mutex);
+			break;
+	}
 }
 
-static inline uint32_t reciprocal_divide(uint32_t A, uint32_t R)
+/* 返回1表示锁被占用, 发生了等待 */
+static inline int mempool_lock(mempool_lock_t *lock)
 {
-	return (uint32_t)(((uint64_t)A * R) >> 32);
+	uint32_t ticket, spins = 0;
+
+	switch (lock->type) {
+		case MEMPOOL_LOCK_NONE:
+			return 0;
+		case MEMPOOL_LOCK_SPIN:
+			if (!pthread_spin_trylock(&lock->spin))
+				return 0;
+			pthread_spin_lock(&lock->spin);
+			return 1;
+		case MEMPOOL_LOCK_MUTEX:
+			if (!pthread_mutex_trylock(&lock->mutex))
+				return 0;
+			pthread_mutex_lock(&lock->mutex);
+			return 1;
+		case MEMPOOL_LOCK_TICKET:
+			ticket = __atomic_fetch_add(&lock->ticket.next, 1, __ATOMIC_RELAXED);
+			if (__atomic_load_n(&lock->ticket.owner, __ATOMIC_ACQUIRE) == ticket)
+				return 0;
+			while (__atomic_load_n(&lock->ticket.owner, __ATOMIC_ACQUIRE) != ticket) {
+				/* 持锁者被抢占时让出CPU, 避免排队线程空转 */
+				if (++spins & 0x3f)
+					cpu_relax();
+				else
+					sched_yield();
+			}
+			return 1;
+		default:
+			if (!sem_trywait(&lock->sem))
+				return 0;
+			sem_wait(&lock->sem);
+			return 1;
+	}
 }
 
-static inline uint32_t obj_to_index(smempool_t *mempool, void *objp)
+static inline void mempool_unlock(mempool_lock_t *lock)
 {
-	uint32_t offset = (objp - mempool->smem);
-#if 0
-	return reciprocal_divide(offset, mempool->ele_asize);
-#else
-	return (offset/mempool->ele_asize);
-#endif
+	switch (lock->type) {
+		case MEMPOOL_LOCK_NONE:
+			break;
+		case MEMPOOL_LOCK_SPIN:
+			pthread_spin_unlock(&lock->spin);
+			break;
+		case MEMPOOL_LOCK_MUTEX:
+			pthread_mutex_unlock(&lock->mutex);
+			break;
+		case MEMPOOL_LOCK_TICKET:
+			__atomic_store_n(&lock->ticket.owner, lock->ticket.owner + 1, __ATOMIC_RELEASE);
+			break;
+		default:
+			sem_post(&lock->sem);
+			break;
+	}
 }
 
 /*
- * 指定大小为size的内存池
- *
- *	+--------------------------------------+
- *      |         |            | |    |        |
- *      | smempool| smem_bufctl| |ele0|......  |
- *      |         |            | |    |        |
- *	+--------------------------------------+
- *
+ * 统计计数: 按线程分片, 计数只做relaxed原子加, 读取时汇总各分片,
+ * 不需要停止分配
  */
+#define MEMPOOL_STAT_SHARDS	16
+
+struct mempool_counters {
+	struct {
+		uint64_t allocs;
+		uint64_t frees;
+		uint64_t failures;
+		uint64_t contended;
+		uint64_t errors;
+		uint64_t order_allocs[MEMPOOL_STAT_ORDERS];
+		uint64_t class_allocs[MMEMPOOL_SLAB_CLASSES];
+	} __attribute__((aligned(64))) shard[MEMPOOL_STAT_SHARDS];
+	uint64_t high_water;
+};
+
+static __thread int stat_shard = -1;
+static uint32_t stat_shard_next;
+
+static inline int mempool_stat_shard(void)
+{
+	if (stat_shard < 0)
+		stat_shard = __atomic_fetch_add(&stat_shard_next, 1, __ATOMIC_RELAXED) % MEMPOOL_STAT_SHARDS;
+	return stat_shard;
+}
 
-smempool_t *smempool_create(void *mem_ptr, uint32_t mem_size, uint32_t element_size, uint32_t align)
+#define mempool_stat_add(stats, field, n) do { \
+		if (stats) \
+			__atomic_fetch_add(&(stats)->shard[mempool_stat_shard()].field, \
+				(n), __ATOMIC_RELAXED); \
+	} while (0)
+
+static inline void mempool_stat_high_water(struct mempool_counters *stats, uint64_t inuse)
 {
-	smempool_t *mempool;
-	int i;
+	uint64_t hw;
 
-	if (!mem_size)
+	if (!stats)
+		return;
+	hw = __atomic_load_n(&stats->high_water, __ATOMIC_RELAXED);
+	while (inuse > hw && !__atomic_compare_exchange_n(&stats->high_water, &hw, inuse, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static struct mempool_counters *mempool_stats_create(uint32_t flags)
+{
+	struct mempool_counters *stats;
+
+	if (!(flags & MEMPOOL_F_STATS))
+		return NULL;
+	if (posix_memalign((void **)&stats, 64, sizeof(*stats)))
 		return NULL;
-	if (!mem_ptr)
-		mem_ptr  = (uint8_t *)malloc(mem_size);
+	memset(stats, 0, sizeof(*stats));
+	return stats;
+}
 
-	mempool = (smempool_t *)mem_ptr;
-	sem_init(&mempool->sem, 0, 0);
-	mempool->mem_size = mem_size;
-	mempool->align = (!align) ? ALIGN_SIZE : align;
-	mempool->ele_ssize = element_size;
-	mempool->ele_asize = ALIGN((element_size), mempool->align);
-	mempool->ele_num = (mempool->mem_size-sizeof(smempool_t))/(sizeof(smem_bufctl_t)+mempool->ele_asize);
-	mempool->smem = mem_ptr+mempool->mem_size-(mempool->ele_num*mempool->ele_asize);
-	mempool->free = 0;
-	mempool->inuse = 0;
-	for (i=0;i<mempool->ele_num;i++)
-		smem_bufctl(mempool)[i]=i+1;
+static void mempool_stats_snapshot(struct mempool_counters *stats, mempool_stats_t *st)
+{
+	uint32_t i, j;
 
-#ifdef DEBUG
-#if 1
-	dump_mempool(mempool, smem, "%p");
-	dump_mempool(mempool, mem_size, "%u");
-	dump_mempool(mempool, align, "%u");
-	dump_mempool(mempool, ele_ssize, "%u");
-	dump_mempool(mempool, ele_asize, "%u");
-	dump_mempool(mempool, ele_num, "%u");
-#endif
+	memset(st, 0, sizeof(*st));
+	if (!stats)
+		return;
+	for (i = 0; i < MEMPOOL_STAT_SHARDS; i++) {
+		st->allocs += __atomic_load_n(&stats->shard[i].allocs, __ATOMIC_RELAXED);
+		st->frees += __atomic_load_n(&stats->shard[i].frees, __ATOMIC_RELAXED);
+		st->failures += __atomic_load_n(&stats->shard[i].failures, __ATOMIC_RELAXED);
+		st->contended += __atomic_load_n(&stats->shard[i].contended, __ATOMIC_RELAXED);
+		st->errors += __atomic_load_n(&stats->shard[i].errors, __ATOMIC_RELAXED);
+		for (j = 0; j < MEMPOOL_STAT_ORDERS; j++)
+			st->order_allocs[j] += __atomic_load_n(&stats->shard[i].order_allocs[j], __ATOMIC_RELAXED);
+		for (j = 0; j < MMEMPOOL_SLAB_CLASSES; j++)
+			st->class_allocs[j] += __atomic_load_n(&stats->shard[i].class_allocs[j], __ATOMIC_RELAXED);
+	}
+	st->high_water = __atomic_load_n(&stats->high_water, __ATOMIC_RELAXED);
+}
+
+#define pool_lock(pool) do { \
+		if (mempool_lock(&(pool)->lock)) \
+			mempool_stat_add((pool)->stats, contended, 1); \
+	} while (0)
+#define pool_unlock(pool)	mempool_unlock(&(pool)->lock)
+
+/*
+ * 内存检查工具注解, 编译时选择(make asan / make valgrind), 默认全部为空:
+ *	-DMEMPOOL_ASAN		AddressSanitizer, 空闲元素/chunk内部和申请大小之后的
+ *				剩余空间poison, 越界和释放后访问在出错指令处报告
+ *	-DMEMPOOL_VALGRIND	memcheck的mempool client request, 对象按可用大小登记
+ * 池内元数据(chunk头部, mslab头部)保持可访问, 分配器在写入新的头部前先标记为可访问;
+ * 空闲chunk的链表节点只在链表操作时可访问.
+ * anno_alloc/anno_free/anno_resize以对象为单位, size为申请的大小, usable为可用大小;
+ * noaccess/defined为内存池内部使用; undefined用于销毁时把内存还给调用者;
+ * usable在调用者查询可用大小后放开剩余空间.
+ */
+#if defined(MEMPOOL_VALGRIND)
+#include <valgrind/memcheck.h>
+#define MEMPOOL_ANNOTATE	1
+#define mempool_anno_create(pool)	VALGRIND_CREATE_MEMPOOL(pool, 0, 0)
+#define mempool_anno_destroy(pool)	VALGRIND_DESTROY_MEMPOOL(pool)
+#define mempool_anno_alloc(pool, p, size, usable)	VALGRIND_MEMPOOL_ALLOC(pool, p, usable)
+#define mempool_anno_free(pool, p, usable)	VALGRIND_MEMPOOL_FREE(pool, p)
+#define mempool_anno_resize(pool, p, size, old, usable) do { \
+		VALGRIND_MEMPOOL_CHANGE(pool, p, p, usable); \
+		if ((usable) > (old)) \
+			VALGRIND_MAKE_MEM_UNDEFINED((char *)(p) + (old), (usable) - (old)); \
+	} while (0)
+#define mempool_anno_noaccess(p, n)	VALGRIND_MAKE_MEM_NOACCESS(p, n)
+#define mempool_anno_defined(p, n)	VALGRIND_MAKE_MEM_DEFINED(p, n)
+#define mempool_anno_undefined(p, n)	VALGRIND_MAKE_MEM_UNDEFINED(p, n)
+#define mempool_anno_usable(p, n)	((void)0)
+#elif defined(MEMPOOL_ASAN)
+#include <sanitizer/asan_interface.h>
+#define MEMPOOL_ANNOTATE	1
+#define mempool_anno_create(pool)	((void)0)
+#define mempool_anno_destroy(pool)	((void)0)
+#define mempool_anno_alloc(pool, p, size, usable) do { \
+		ASAN_UNPOISON_MEMORY_REGION(p, size); \
+		ASAN_POISON_MEMORY_REGION((char *)(p) + (size), (usable) - (size)); \
+	} while (0)
+#define mempool_anno_free(pool, p, usable)	ASAN_POISON_MEMORY_REGION(p, usable)
+#define mempool_anno_resize(pool, p, size, old, usable)	mempool_anno_alloc(pool, p, size, usable)
+#define mempool_anno_noaccess(p, n)	ASAN_POISON_MEMORY_REGION(p, n)
+#define mempool_anno_defined(p, n)	ASAN_UNPOISON_MEMORY_REGION(p, n)
+#define mempool_anno_undefined(p, n)	ASAN_UNPOISON_MEMORY_REGION(p, n)
+#define mempool_anno_usable(p, n)	ASAN_UNPOISON_MEMORY_REGION(p, n)
+#else
+#define MEMPOOL_ANNOTATE	0
+#define mempool_anno_create(pool)	((void)0)
+#define mempool_anno_destroy(pool)	((void)0)
+#define mempool_anno_alloc(pool, p, size, usable)	((void)0)
+#define mempool_anno_free(pool, p, usable)	((void)0)
+#define mempool_anno_resize(pool, p, size, old, usable)	((void)0)
+#define mempool_anno_noaccess(p, n)	((void)0)
+#define mempool_anno_defined(p, n)	((void)0)
+#define mempool_anno_undefined(p, n)	((void)0)
+#define mempool_anno_usable(p, n)	((void)0)
 #endif
-	sem_post(&mempool->sem);
 
-	return mempool;
+/*
+ * 调试模式(MEMPOOL_F_DEBUG), 同kernel slab的red zone/poison:
+ * 对象之后(mmempool为可用空间末尾)有一个64位red zone, 使用中为RED_ACTIVE,
+ * 释放后为RED_INACTIVE, 每次释放都据此检查重复释放和越界写.
+ * 每个线程每mempool_debug_sample次释放抽样一次(同KFENCE/GWP-ASan的思路,
+ * 开销可以长期打开, 默认MEMPOOL_DEBUG_SAMPLE, mempool_set_debug_sample(1)为
+ * 所有内存池每次释放都抽中; 创建时加MEMPOOL_F_DEBUG_ALL只对该内存池每次都抽中,
+ * 用于需要完整覆盖的灰度部署): 抽中的对象开头MEMPOOL_POISON_BYTES字节填充POISON_FREE,
+ * 先放入FIFO隔离区, 之后再有MEMPOOL_QUARANTINE次抽样释放才真正归还,
+ * 离开隔离区时检查填充是否被改写(释放后写). 抽样间隔越大, 对象在隔离区中
+ * 停留的时间越长. mmempool的对象大小不一, 隔离区另有字节上限
+ * (mem_size >> MMEMPOOL_QUARANTINE_SHIFT), 超过时提前挤出最早的对象.
+ * 错误总是输出到stderr(与DEBUG编译选项无关), 并计入统计的errors;
+ * 有问题的对象不再归还, 泄漏比破坏内存池安全.
+ */
+#define RED_INACTIVE		0x09F911029D74E35BULL
+#define RED_ACTIVE		0xD84156C5635688C0ULL
+#define POISON_FREE		0x6b
+#define MEMPOOL_REDZONE		sizeof(uint64_t)
+#define MEMPOOL_POISON_BYTES	256
+
+static uint32_t mempool_debug_sample = MEMPOOL_DEBUG_SAMPLE;
+static __thread uint32_t mempool_debug_tick;
+
+void mempool_set_debug_sample(uint32_t n)
+{
+	__atomic_store_n(&mempool_debug_sample, n ? n : 1, __ATOMIC_RELAXED);
 }
 
-void smempool_destroy(smempool_t *mempool)
+/* 本次释放是否抽样poison和隔离, MEMPOOL_F_DEBUG_ALL的内存池每次都是 */
+static inline int mempool_debug_sampled(uint32_t flags)
 {
-	if (!mempool)
-		return ;
-	sem_destroy(&mempool->sem);
-	free(mempool);
+	if (flags & MEMPOOL_F_DEBUG_ALL)
+		return 1;
+	if (++mempool_debug_tick < __atomic_load_n(&mempool_debug_sample, __ATOMIC_RELAXED))
+		return 0;
+	mempool_debug_tick = 0;
+	return 1;
 }
 
-void *smempool_alloc(smempool_t *mempool)
+/* 多一个位置, push之后再pop */
+#define MEMPOOL_QUARANTINE_SLOTS	(MEMPOOL_QUARANTINE + 1)
+
+struct mempool_quarantine {
+	uint32_t head;			/* 最早放入的对象 */
+	uint32_t count;
+	uint64_t bytes;			/* 隔离中对象的字节数 */
+	uint64_t max_bytes;		/* 字节上限, 0为只限个数 */
+	void *obj[MEMPOOL_QUARANTINE_SLOTS];
+	uint32_t size[MEMPOOL_QUARANTINE_SLOTS];
+};
+
+static struct mempool_quarantine *mempool_quarantine_create(uint32_t flags, uint64_t max_bytes)
 {
-	void *objp;
-	smem_bufctl_t next;
+	struct mempool_quarantine *q;
 
-	if (!mempool || mempool->inuse == mempool->ele_num)
+	if (!(flags & MEMPOOL_F_DEBUG))
 		return NULL;
-	sem_wait(&mempool->sem);
-	objp = index_to_obj(mempool, mempool->free);
-	mempool->inuse++;
-	next = smem_bufctl(mempool)[mempool->free];
-	smem_bufctl(mempool)[mempool->free] = 0;
-	mempool->free = next;
+	q = (struct mempool_quarantine *)calloc(1, sizeof(struct mempool_quarantine));
+	if (q)
+		q->max_bytes = max_bytes;
+	return q;
+}
 
-	sem_post(&mempool->sem);
-	pr_debug("inuse=%u,free=%u,objp=%p\n", mempool->inuse, mempool->free, objp);
+/* 放入size字节的objp, 之后需用mempool_quarantine_pop取出超限的对象. 调用者需持锁 */
+static void mempool_quarantine_push(struct mempool_quarantine *q, void *objp, uint32_t size)
+{
+	uint32_t tail = (q->head + q->count) % MEMPOOL_QUARANTINE_SLOTS;
 
-	return objp;
+	q->obj[tail] = objp;
+	q->size[tail] = size;
+	q->count++;
+	q->bytes += size;
 }
 
-void smempool_free(smempool_t *mempool, void *objp)
+/* 超过个数或字节上限时取出最早的对象, 返回需要真正释放的对象, 没有时返回NULL. 调用者需持锁 */
+static void *mempool_quarantine_pop(struct mempool_quarantine *q)
 {
-	uint32_t objnr;
+	void *old;
 
-	if (!objp)
-		return;
+	if (q->count <= MEMPOOL_QUARANTINE && (!q->max_bytes || q->bytes <= q->max_bytes))
+		return NULL;
+	old = q->obj[q->head];
+	q->bytes -= q->size[q->head];
+	q->count--;
+	if (++q->head == MEMPOOL_QUARANTINE_SLOTS)
+		q->head = 0;
+	return old;
+}
 
-	sem_wait(&mempool->sem);
-	objnr = obj_to_index(mempool, objp);
-	if (smem_bufctl(mempool)[objnr] != 0) {
-		sem_post(&mempool->sem);
-		return ;
-	}
-	smem_bufctl(mempool)[objnr] = mempool->free;
-	mempool->free = objnr;
-	mempool->inuse--;
+/* red zone不一定按8字节对齐, 在注解构建中保持不可访问 */
+static inline uint64_t mempool_redzone_get(void *rz)
+{
+	uint64_t red;
 
-	sem_post(&mempool->sem);
-	pr_debug("inuse=%u,free=%u,objp=%p,objnr=%u,bufctl=%u\n",
-		mempool->inuse, mempool->free, objp, objnr, smem_bufctl(mempool)[objnr]);
-	return ;
+	mempool_anno_defined(rz, sizeof(red));
+	memcpy(&red, rz, sizeof(red));
+	mempool_anno_noaccess(rz, sizeof(red));
+	return red;
 }
 
+static inline void mempool_redzone_set(void *rz, uint64_t red)
+{
+	mempool_anno_defined(rz, sizeof(red));
+	memcpy(rz, &red, sizeof(red));
+	mempool_anno_noaccess(rz, sizeof(red));
+}
 
-/*
- * 指定包含大小为size(必须为2的n次方,建议4K以上),size*2^1,size*2^2...size*2^(m-1)
- * 连续m种大小的内存池
- *
- */
+/* 调用者随后把对象标记为不可访问 */
+static inline void mempool_poison(void *objp, size_t size)
+{
+	mempool_anno_defined(objp, min_t(size_t, size, MEMPOOL_POISON_BYTES));
+	memset(objp, POISON_FREE, min_t(size_t, size, MEMPOOL_POISON_BYTES));
+}
 
-#define order2bytes(n) (1<<(n))
+/* 填充被改写时返回1, 按64位比较 */
+static int mempool_poison_check(void *objp, size_t size)
+{
+	const uint64_t pattern = 0x0101010101010101ULL * POISON_FREE;
+	const uint8_t *p = objp;
+	size_t i, n = min_t(size_t, size, MEMPOOL_POISON_BYTES);
+	uint64_t acc = 0, w;
+
+	mempool_anno_defined(objp, n);
+	for (i = 0; i + sizeof(w) <= n; i += sizeof(w)) {
+		memcpy(&w, p + i, sizeof(w));
+		acc |= w ^ pattern;
+	}
+	for (; i < n; i++)
+		acc |= p[i] ^ POISON_FREE;
+	mempool_anno_noaccess(objp, n);
+	return acc != 0;
+}
 
-#define OVERHEAD (2*sizeof(size_t))
-#define CHUNK_SIZE(c)	((c)->csize & -4)
-#define CHUNK_PSIZE(c)	((c)->psize & -4)
-#define PREV_CHUNK(c)	((struct chunk *)((char *)(c) - CHUNK_PSIZE(c)))
-#define NEXT_CHUNK(c)	((struct chunk *)((char *)(c) + CHUNK_SIZE(c)))
-#define CHUNK_TO_MEM(c) (void *)((char *)(c) + OVERHEAD)
-#define MEM_TO_CHUNK(p) (struct chunk *)((char *)(p) - OVERHEAD)
+static void mempool_report(struct mempool_counters *stats, const char *type, void *mempool,
+		void *objp, const char *what)
+{
+	fprintf(stderr, "mempool: %s, %s=%p, objp=%p\n", what, type, mempool, objp);
+	mempool_stat_add(stats, errors, 1);
+}
 
-#define C_INUSE		((size_t)1)
-#define C_LAST		((size_t)2)
+/*
+ * 内存池后备内存: malloc, 或者mmap(可选hugetlb/THP, NUMA绑定, 预先缺页)
+ */
+#define MEMPOOL_HUGEPAGE_SIZE	(2UL << 20)
+#ifndef MPOL_BIND
+#define MPOL_BIND		2
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE		(1 << 1)
+#endif
 
-mmempool_t *mmempool_create(void *mem_ptr, uint32_t mem_size, uint32_t order_min, uint32_t order_max)
+static inline size_t mempool_region_len(size_t size, uint32_t backing)
 {
-	int free_area_num,i,j;
-	size_t last_size=0;
-	struct chunk *c = NULL;
-	mmempool_t *mempool;
-	char *mmem = NULL;
+	if (backing == MEMPOOL_MEM_HUGETLB)
+		return ALIGN(size, MEMPOOL_HUGEPAGE_SIZE);
+	return ALIGN(size, (size_t)sysconf(_SC_PAGESIZE));
+}
 
-	if (mem_size == 0 || order_min > order_max)
+static void *mempool_region_map(size_t size, size_t align, uint32_t flags, uint32_t *backing)
+{
+	int mflags = MAP_ANONYMOUS;
+	size_t len, extra = 0;
+	char *mem, *aligned;
+
+	/* 共享模式下fork出的子进程可以直接使用 */
+	mflags |= (flags & MEMPOOL_F_SHARED) ? MAP_SHARED : MAP_PRIVATE;
+	/* 需要NUMA绑定时, 先mbind再预先缺页 */
+	if ((flags & MEMPOOL_F_POPULATE) && MEMPOOL_NUMA_NODE(flags) < 0)
+		mflags |= MAP_POPULATE;
+#ifdef MAP_HUGETLB
+	if ((flags & MEMPOOL_F_HUGETLB) && align <= MEMPOOL_HUGEPAGE_SIZE) {
+		len = mempool_region_len(size, MEMPOOL_MEM_HUGETLB);
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE, mflags | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED) {
+			*backing = MEMPOOL_MEM_HUGETLB;
+			return mem;
+		}
+		pr_wrn("MAP_HUGETLB failed, errno=%d, fall back to THP\n", errno);
+		flags |= MEMPOOL_F_THP;
+	}
+#endif
+	len = mempool_region_len(size, MEMPOOL_MEM_MMAP);
+	/* THP需要2M对齐, 多映射一些再裁掉头尾 */
+	if ((flags & MEMPOOL_F_THP) && align < MEMPOOL_HUGEPAGE_SIZE)
+		align = MEMPOOL_HUGEPAGE_SIZE;
+	if (align > (size_t)sysconf(_SC_PAGESIZE))
+		extra = align;
+	mem = mmap(NULL, len + extra, PROT_READ | PROT_WRITE, mflags, -1, 0);
+	if (mem == MAP_FAILED)
 		return NULL;
+	if (extra) {
+		aligned = (char *)ALIGN((uintptr_t)mem, align);
+		if (aligned != mem)
+			munmap(mem, aligned - mem);
+		if (aligned + len != mem + len + extra)
+			munmap(aligned + len, (mem + len + extra) - (aligned + len));
+		mem = aligned;
+	}
+#ifdef MADV_HUGEPAGE
+	if (flags & MEMPOOL_F_THP)
+		madvise(mem, len, MADV_HUGEPAGE);
+#endif
+	*backing = MEMPOOL_MEM_MMAP;
+	return mem;
+}
 
+/* align为0或2的n次方, 返回的地址按align对齐 */
+static void *mempool_region_alloc_aligned(size_t size, size_t align, uint32_t flags, uint32_t *backing)
+{
+	unsigned long nodemask;
+	int node = MEMPOOL_NUMA_NODE(flags);
+	size_t len, off, page;
+	void *mem;
+
+	if (!(flags & (MEMPOOL_F_MMAP | MEMPOOL_F_HUGETLB | MEMPOOL_F_THP | MEMPOOL_F_POPULATE | MEMPOOL_F_SHARED)) && node < 0) {
+		*backing = MEMPOOL_MEM_MALLOC;
+		if (!align)
+			return malloc(size);
+		return posix_memalign(&mem, align, size) ? NULL : mem;
+	}
+	mem = mempool_region_map(size, align, flags, backing);
+	if (!mem)
+		return NULL;
+	len = mempool_region_len(size, *backing);
+	if (node >= 0 && node < (int)(8 * sizeof(nodemask))) {
+		nodemask = 1UL << node;
+		if (syscall(SYS_mbind, mem, len, MPOL_BIND, &nodemask, 8 * sizeof(nodemask), MPOL_MF_MOVE) < 0)
+			pr_wrn("mbind node %d failed, errno=%d\n", node, errno);
+		if (flags & MEMPOOL_F_POPULATE) {
+			page = (*backing == MEMPOOL_MEM_HUGETLB) ? MEMPOOL_HUGEPAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+			for (off = 0; off < len; off += page)
+				((volatile char *)mem)[off] = 0;
+		}
+	}
+	pr_debug("region=%p, len=%zu, backing=%u\n", mem, len, *backing);
 
-	mempool = (mmempool_t *)malloc(sizeof(mmempool_t));
+	return mem;
+}
 
-	sem_init(&mempool->sem, 0, 0);
+static inline void *mempool_region_alloc(size_t size, uint32_t flags, uint32_t *backing)
+{
+	return mempool_region_alloc_aligned(size, 0, flags, backing);
+}
 
-	if (!mem_ptr) {
-		mempool->mmem = malloc(mem_size);
-/*
-		pr_emerg("LAST->psize=0x%x, LAST->csize=0x%x\n",
-			(uint32_t)((struct chunk *)(mempool->mmem+mem_size))->psize,
-			(uint32_t)((struct chunk *)(mempool->mmem+mem_size))->csize);
-*/
-		mempool->external_mem = 0;
-	} else {
-		mempool->mmem = mem_ptr;
-		mempool->external_mem = 1;
+static void mempool_region_free(void *mem, size_t size, uint32_t backing)
+{
+	switch (backing) {
+		case MEMPOOL_MEM_MALLOC:
+			free(mem);
+			break;
+		case MEMPOOL_MEM_MMAP:
+		case MEMPOOL_MEM_HUGETLB:
+			munmap(mem, mempool_region_len(size, backing));
+			break;
 	}
-	pr_debug("!!!!!!mmem = %p\n", mempool->mmem);
-	mempool->mem_size = mem_size;
-	mempool->order_max = order_max;
-	mempool->order_min = order_min;
+}
 
-	order_max += 10;
-	order_min += 10;
+/*
+ * 空闲元素的bufctl为下一个空闲元素的下标(0...ele_num), 分配出去的元素为
+ * SMEM_BUFCTL_INUSE, 缓存在magazine中的为SMEM_BUFCTL_CACHED
+ */
+#define SMEM_BUFCTL_INUSE	((smem_bufctl_t)-1)
+#define SMEM_BUFCTL_CACHED	((smem_bufctl_t)-2)
 
-	/* free_area init */
-	free_area_num = order_max-order_min + 1;
-	mempool->free_area = (struct free_area *)malloc(free_area_num * sizeof(struct free_area));
-	pr_debug("!!!!!!free_area= %p\n", mempool->free_area);
+static inline smem_bufctl_t *smem_bufctl(smempool_t *smem)
+{
+	return (smem_bufctl_t *)(smem+1);
+}
 
-	mmem = mempool->mmem;
-	for (i = 1; i < free_area_num + 1; i++) {
-		struct list_head *head = &mempool->free_area[free_area_num-i].free_list;
-		if (i==1)
-			mempool->free_area[free_area_num-i].nr_free = mem_size>>(order_max+1-i);
-		else
-			mempool->free_area[free_area_num-i].nr_free = (mem_size>>(order_max+1-i))&0x01;
-		INIT_LIST_HEAD(head);
-		pr_debug("order=%u, nr_free=%u\n", order_max+1-i, mempool->free_area[free_area_num-i].nr_free);
-		for (j = 0; j < mempool->free_area[free_area_num-i].nr_free; j++) {
-			c = (struct chunk *)mmem;
-			pr_debug("!!!!!!chunk=%p\n", c);
-			c->psize = last_size;
-			c->csize = order2bytes(order_max+1-i);
-			last_size = c->csize;
-			mmem += c->csize;
-			list_add_tail(&c->list, head);
-			pr_debug("psize=%u, csize=%u\n", (uint32_t)c->psize, (uint32_t)c->csize);
-		}
+static inline void *smem_base(smempool_t *mempool)
+{
+	return (char *)mempool + mempool->smem_off;
+}
+
+static inline void *index_to_obj(smempool_t *mempool, uint32_t idx)
+{
+	return smem_base(mempool) + mempool->ele_asize * idx;
+}
+
+/*
+ * 除数不变的除法用乘法代替(同linux lib/reciprocal_div.c):
+ *	m = 2^32 * (2^l - d) / d + 1, l = fls(d - 1)
+ *	t = (a * m) >> 32
+ *	a / d = (t + ((a - t) >> sh1)) >> sh2
+ * 对所有32位的a都精确. d为2的n次方时直接移位.
+ */
+static struct mempool_reciprocal reciprocal_value(uint32_t d)
+{
+	struct mempool_reciprocal R;
+	uint64_t m;
+	int l;
+
+	memset(&R, 0, sizeof(R));
+	if (!(d & (d - 1))) {
+		R.pow2 = 1;
+		R.sh2 = __builtin_ctz(d);
+		return R;
 	}
-	if (c != NULL)
-		c->csize |= C_LAST;
-	sem_post(&mempool->sem);
-	return mempool;
+	l = 32 - __builtin_clz(d - 1);
+	m = ((1ULL << 32) * ((1ULL << l) - d)) / d + 1;
+	R.m = (uint32_t)m;
+	R.sh1 = 1;
+	R.sh2 = l - 1;
+	return R;
 }
 
-void mmempool_destroy(mmempool_t *mempool)
+static inline uint32_t reciprocal_divide(uint32_t a, struct mempool_reciprocal R)
 {
-	if (!mempool)
-		return;
-	if (!mempool->external_mem)
-		free(mempool->mmem);
-	sem_destroy(&mempool->sem);
-	free(mempool);
+	uint32_t t;
+
+	if (R.pow2)
+		return a >> R.sh2;
+	t = (uint32_t)(((uint64_t)a * R.m) >> 32);
+	return (t + ((a - t) >> R.sh1)) >> R.sh2;
 }
 
-uint32_t mmempool_remain_size(mmempool_t *mempool)
+static inline uint32_t obj_to_index(smempool_t *mempool, void *objp)
 {
-	uint32_t size=0,i=0;
+	uint32_t offset = (objp - smem_base(mempool));
 
-	if (!mempool)
+	return reciprocal_divide(offset, mempool->ele_recip);
+}
+
+/*
+ * 不持锁的释放(magazine/无锁/远程释放): 用CAS把元素由使用中改为CACHED,
+ * 同一元素的并发重复释放只有一个成功, 返回0表示越界或已经空闲
+ */
+static inline int smem_obj_claim(smempool_t *mempool, smem_bufctl_t objnr)
+{
+	smem_bufctl_t inuse = SMEM_BUFCTL_INUSE;
+
+	if (objnr >= mempool->ele_num)
 		return 0;
-	sem_wait(&mempool->sem);
-	for (i=mempool->order_min;i<=mempool->order_max;i++) {
-		size += mempool->free_area[i].nr_free << (10+i);
+	return __atomic_compare_exchange_n(&smem_bufctl(mempool)[objnr], &inuse, SMEM_BUFCTL_CACHED,
+			0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/*
+ * 无锁模式: 空闲链表头为64位 {tag, index}, 每次修改tag加1, 避免ABA
+ */
+#define LF_HEAD(tag, idx)	(((uint64_t)(tag) << 32) | (uint32_t)(idx))
+#define LF_INDEX(head)		((smem_bufctl_t)(head))
+#define LF_TAG(head)		((uint32_t)((head) >> 32))
+
+static uint32_t smem_lf_get(smempool_t *mempool, smem_bufctl_t *objnr, uint32_t n)
+{
+	uint64_t old, new;
+	smem_bufctl_t idx, next;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		old = __atomic_load_n(&mempool->head, __ATOMIC_ACQUIRE);
+		do {
+			idx = LF_INDEX(old);
+			if (idx >= mempool->ele_num)
+				goto out;
+			next = __atomic_load_n(&smem_bufctl(mempool)[idx], __ATOMIC_RELAXED);
+			new = LF_HEAD(LF_TAG(old) + 1, next);
+		} while (!__atomic_compare_exchange_n(&mempool->head, &old, new, 1,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+		__atomic_store_n(&smem_bufctl(mempool)[idx], SMEM_BUFCTL_INUSE, __ATOMIC_RELAXED);
+		objnr[i] = idx;
 	}
-	sem_post(&mempool->sem);
+out:
+	__atomic_add_fetch(&mempool->inuse, i, __ATOMIC_RELAXED);
+	return i;
+}
+
+static void smem_lf_put(smempool_t *mempool, smem_bufctl_t *objnr, uint32_t n)
+{
+	uint64_t old, new;
+	uint32_t i;
 
-	return size;
+	if (!n)
+		return;
+	/* 先在本地串成一条链, 再一次CAS挂到链表头 */
+	for (i = 0; i < n - 1; i++)
+		__atomic_store_n(&smem_bufctl(mempool)[objnr[i]], objnr[i+1], __ATOMIC_RELAXED);
+	old = __atomic_load_n(&mempool->head, __ATOMIC_ACQUIRE);
+	do {
+		__atomic_store_n(&smem_bufctl(mempool)[objnr[n-1]], LF_INDEX(old), __ATOMIC_RELAXED);
+		new = LF_HEAD(LF_TAG(old) + 1, objnr[0]);
+	} while (!__atomic_compare_exchange_n(&mempool->head, &old, new, 1,
+			__ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+	__atomic_sub_fetch(&mempool->inuse, n, __ATOMIC_RELAXED);
 }
 
-static inline int32_t byte2kborder(uint32_t bytes)
+/*
+ * 位图模式: bufctl换成分层位图, 第0层每位对应一个元素(1为空闲),
+ * 第k层每位对应第k-1层的一个64位字是否非0. 分配从最高层开始逐层ctz,
+ * 总是取下标最小的空闲元素, 没有链表的依赖加载; 每个元素约1/8字节开销.
+ * 最高层超过一个字时(超过64^(SMEMPOOL_BITMAP_LEVELS-1)个字的元素)顺序扫描.
+ */
+static inline uint64_t *smem_bm(smempool_t *mempool, uint32_t level)
 {
-	int32_t len,order;
+	return (uint64_t *)(mempool+1) + mempool->bm_off[level];
+}
 
-	len = sizeof(bytes)*8;
-	for (order=len-1;order>=0;order--){
-		if (bytes&(1<<order))
+/* n个元素的位图布局, 返回总字数 */
+static uint32_t smem_bm_layout(uint32_t n, uint32_t *off, uint32_t *levels, uint32_t *top)
+{
+	uint32_t words = (n + 63) / 64, total = 0, l = 0;
+
+	for (;;) {
+		if (off)
+			off[l] = total;
+		total += words;
+		l++;
+		if (words <= 1 || l == SMEMPOOL_BITMAP_LEVELS)
 			break;
+		words = (words + 63) / 64;
 	}
-	//pr_debug("bytes=%u,0x%x,order=%u\n", bytes, bytes, order);
-	if (bytes&((1<<order)-1))
-		order++;
-	if (order == 0)
-		order = -1;
-	else if (order <= 10)
-		order = 0;
-	else
-		order -= 10;
-	//pr_debug("actual order=%u\n", order);
-	return order;
+	*levels = l;
+	*top = words;
+	return total;
 }
 
-void mmempool_dump(mmempool_t *mempool)
+/* bufctl或位图的字节数 */
+static inline size_t smem_meta_size(uint32_t flags, uint32_t n)
+{
+	uint32_t levels, top;
+
+	if (flags & MEMPOOL_F_BITMAP)
+		return (size_t)smem_bm_layout(n, NULL, &levels, &top) * sizeof(uint64_t);
+	return (size_t)n * sizeof(smem_bufctl_t);
+}
+
+static void smem_bm_init(smempool_t *mempool)
+{
+	uint32_t l, i, words, n = mempool->ele_num;
+	uint64_t *bm;
+
+	smem_bm_layout(n, mempool->bm_off, &mempool->bm_levels, &mempool->bm_top);
+	for (l = 0; l < mempool->bm_levels; l++) {
+		bm = smem_bm(mempool, l);
+		words = (n + 63) / 64;
+		for (i = 0; i < words; i++)
+			bm[i] = ~0ULL;
+		if (n & 63)
+			bm[words-1] = (1ULL << (n & 63)) - 1;
+		n = words;
+	}
+}
+
+/* 第一个非0字的下标, 全为0返回-1 */
+static inline int32_t smem_bm_scan(const uint64_t *bm, uint32_t words)
+{
+	uint32_t i = 0;
+
+#ifdef __AVX2__
+	/* 一次检查256位 */
+	for (; i + 4 <= words; i += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(bm + i));
+		if (!_mm256_testz_si256(v, v))
+			break;
+	}
+#endif
+	for (; i < words; i++) {
+		if (bm[i])
+			return i;
+	}
+	return -1;
+}
+
+static uint32_t smem_bm_get(smempool_t *mempool, smem_bufctl_t *objnr, uint32_t n)
+{
+	uint32_t top = mempool->bm_levels - 1;
+	uint32_t i, l, idx;
+	uint64_t *bm;
+	int32_t w;
+
+	for (i = 0; i < n; i++) {
+		w = smem_bm_scan(smem_bm(mempool, top), mempool->bm_top);
+		if (w < 0)
+			break;
+		/* 逐层向下, idx为下一层的字下标, 最后为元素下标 */
+		idx = w;
+		for (l = top + 1; l-- > 0; )
+			idx = idx * 64 + __builtin_ctzll(smem_bm(mempool, l)[idx]);
+		objnr[i] = idx;
+		/* 清除该位, 字变为0时继续清除上一层 */
+		for (l = 0; l <= top; l++) {
+			bm = smem_bm(mempool, l) + idx / 64;
+			*bm &= ~(1ULL << (idx % 64));
+			if (*bm)
+				break;
+			idx /= 64;
+		}
+	}
+	__atomic_store_n(&mempool->inuse, mempool->inuse + i, __ATOMIC_RELAXED);
+
+	return i;
+}
+
+static void smem_bm_put(smempool_t *mempool, smem_bufctl_t *objnr, uint32_t n)
+{
+	uint32_t top = mempool->bm_levels - 1;
+	uint32_t i, l, idx;
+	uint64_t *bm, old;
+
+	for (i = 0; i < n; i++) {
+		idx = objnr[i];
+		/* 置位, 字由0变为非0时继续设置上一层 */
+		for (l = 0; l <= top; l++) {
+			bm = smem_bm(mempool, l) + idx / 64;
+			old = *bm;
+			*bm = old | (1ULL << (idx % 64));
+			if (old)
+				break;
+			idx /= 64;
+		}
+	}
+	__atomic_store_n(&mempool->inuse, mempool->inuse - n, __ATOMIC_RELAXED);
+}
+
+/* 元素objnr是否空闲, 用于检查重复释放. 加锁模式下需持有mempool->lock */
+static inline int smem_obj_is_free(smempool_t *mempool, smem_bufctl_t objnr)
+{
+	if (mempool->flags & MEMPOOL_F_BITMAP)
+		return (smem_bm(mempool, 0)[objnr / 64] >> (objnr % 64)) & 1;
+	return smem_bufctl(mempool)[objnr] != SMEM_BUFCTL_INUSE;
+}
+
+/* 标记magazine换入换出的元素, 位图模式不能与magazine同时使用 */
+static inline void smem_mark(smempool_t *mempool, smem_bufctl_t *objnr, uint32_t n, smem_bufctl_t state)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		__atomic_store_n(&smem_bufctl(mempool)[objnr[i]], state, __ATOMIC_RELAXED);
+}
+
+/* 注解构建: 共享内存池的ASan影子内存只属于本进程, 不做标记 */
+static inline void smem_anno_alloc(smempool_t *mempool, void *objp)
+{
+	if (!(mempool->flags & MEMPOOL_F_SHARED))
+		mempool_anno_alloc(mempool, objp, mempool->ele_ssize, mempool->ele_ssize);
+}
+
+static inline void smem_anno_free(smempool_t *mempool, void *objp)
+{
+	if (!(mempool->flags & MEMPOOL_F_SHARED))
+		mempool_anno_free(mempool, objp, mempool->ele_ssize);
+}
+
+/*
+ * 从共享空闲链表中取出最多n个元素, 返回实际取出的个数
+ */
+static uint32_t __smem_get(smempool_t *mempool, smem_bufctl_t *objnr, uint32_t n)
+{
+	uint32_t i;
+
+	if (mempool->flags & MEMPOOL_F_BITMAP)
+		return smem_bm_get(mempool, objnr, n);
+
+	for (i = 0; i < n && mempool->inuse + i < mempool->ele_num; i++) {
+		objnr[i] = mempool->free;
+		mempool->free = smem_bufctl(mempool)[objnr[i]];
+		/* 与smem_obj_claim的CAS并发(重复释放), 用原子访问 */
+		__atomic_store_n(&smem_bufctl(mempool)[objnr[i]], SMEM_BUFCTL_INUSE, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&mempool->inuse, mempool->inuse + i, __ATOMIC_RELAXED);
+
+	return i;
+}
+
+static uint32_t smem_get(smempool_t *mempool, smem_bufctl_t *objnr, uint32_t n)
+{
+	uint32_t i;
+
+	if (mempool->flags & MEMPOOL_F_LOCKFREE)
+		return smem_lf_get(mempool, objnr, n);
+	pool_lock(mempool);
+	i = __smem_get(mempool, objnr, n);
+	pool_unlock(mempool);
+
+	return i;
+}
+
+/*
+ * 将n个元素归还到共享空闲链表
+ */
+static void __smem_put(smempool_t *mempool, smem_bufctl_t *objnr, uint32_t n)
+{
+	uint32_t i;
+
+	if (mempool->flags & MEMPOOL_F_BITMAP) {
+		smem_bm_put(mempool, objnr, n);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		__atomic_store_n(&smem_bufctl(mempool)[objnr[i]], mempool->free, __ATOMIC_RELAXED);
+		mempool->free = objnr[i];
+	}
+	__atomic_store_n(&mempool->inuse, mempool->inuse - n, __ATOMIC_RELAXED);
+}
+
+static void smem_put(smempool_t *mempool, smem_bufctl_t *objnr, uint32_t n)
+{
+	if (mempool->flags & MEMPOOL_F_LOCKFREE) {
+		smem_lf_put(mempool, objnr, n);
+		return;
+	}
+	pool_lock(mempool);
+	__smem_put(mempool, objnr, n);
+	pool_unlock(mempool);
+}
+
+/*
+ * 加锁的空闲链表/位图: 在锁内检查重复释放并归还, 返回实际释放的个数
+ */
+static uint32_t smem_put_checked(smempool_t *mempool, smem_bufctl_t *objnr, uint32_t n)
+{
+	uint32_t i, cnt = 0;
+
+	pool_lock(mempool);
+	for (i = 0; i < n; i++) {
+		if (smem_obj_is_free(mempool, objnr[i]))
+			continue;
+		smem_anno_free(mempool, index_to_obj(mempool, objnr[i]));
+		__smem_put(mempool, &objnr[i], 1);
+		cnt++;
+	}
+	pool_unlock(mempool);
+
+	return cnt;
+}
+
+/*
+ * 每线程magazine: 线程私有的空闲元素栈, 分配释放不加内存池的锁,
+ * 空/满时与共享空闲链表成批交换 SMEMPOOL_MAGAZINE_SIZE/2 个元素.
+ * 共享链表也为空时收回其他线程magazine中的元素, 避免还有空闲元素时分配失败.
+ */
+struct smem_magazine {
+	struct list_head list;
+	smempool_t *mempool;
+	uint32_t lock;			/* 本线程使用时持有, 其他线程只在回收时trylock */
+	uint32_t avail;
+	smem_bufctl_t entry[SMEMPOOL_MAGAZINE_SIZE];
+};
+
+#define MAGAZINE_BATCH	(SMEMPOOL_MAGAZINE_SIZE/2)
+
+/* 平时没有竞争, 只是本线程cacheline上的一次原子交换 */
+static inline void smem_mag_lock(struct smem_magazine *mag)
+{
+	while (__atomic_exchange_n(&mag->lock, 1, __ATOMIC_ACQUIRE))
+		cpu_relax();
+}
+
+static inline int smem_mag_trylock(struct smem_magazine *mag)
+{
+	return !__atomic_exchange_n(&mag->lock, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void smem_mag_unlock(struct smem_magazine *mag)
+{
+	__atomic_store_n(&mag->lock, 0, __ATOMIC_RELEASE);
+}
+
+/* 线程退出时, 归还magazine中的元素 */
+static void smem_magazine_release(void *arg)
+{
+	struct smem_magazine *mag = arg;
+	smempool_t *mempool = mag->mempool;
+
+	/* 先摘下, 之后其他线程不会再回收它 */
+	pool_lock(mempool);
+	list_del(&mag->list);
+	pool_unlock(mempool);
+	if (mag->avail)
+		smem_put(mempool, mag->entry, mag->avail);
+	free(mag);
+}
+
+/*
+ * 共享空闲链表为空时, 把其他线程magazine中缓存的元素收回共享链表,
+ * 返回收回的个数. 调用者持有自己的magazine锁, 其他magazine只trylock,
+ * 与"magazine锁 -> 内存池锁"的加锁顺序不会死锁.
+ */
+static uint32_t smem_magazine_drain(smempool_t *mempool, struct smem_magazine *self)
+{
+	struct smem_magazine *mag;
+	uint32_t nr = 0;
+
+	pool_lock(mempool);
+	list_for_each_entry(mag, &mempool->magazines, list) {
+		if (mag == self || !mag->avail || !smem_mag_trylock(mag))
+			continue;
+		if (mempool->flags & MEMPOOL_F_LOCKFREE)
+			smem_lf_put(mempool, mag->entry, mag->avail);
+		else
+			__smem_put(mempool, mag->entry, mag->avail);
+		nr += mag->avail;
+		mag->avail = 0;
+		smem_mag_unlock(mag);
+	}
+	pool_unlock(mempool);
+	pr_debug("drained %u elements from other magazines\n", nr);
+
+	return nr;
+}
+
+static struct smem_magazine *smem_magazine(smempool_t *mempool)
+{
+	struct smem_magazine *mag;
+
+	mag = pthread_getspecific(mempool->mag_key);
+	if (mag)
+		return mag;
+	mag = (struct smem_magazine *)malloc(sizeof(struct smem_magazine));
+	if (!mag)
+		return NULL;
+	mag->mempool = mempool;
+	mag->lock = 0;
+	mag->avail = 0;
+	pool_lock(mempool);
+	list_add(&mag->list, &mempool->magazines);
+	pool_unlock(mempool);
+	pthread_setspecific(mempool->mag_key, mag);
+	pr_debug("new magazine=%p\n", mag);
+
+	return mag;
+}
+
+static void *smem_magazine_alloc(smempool_t *mempool)
+{
+	struct smem_magazine *mag;
+	smem_bufctl_t objnr;
+
+	mag = smem_magazine(mempool);
+	if (!mag) {
+		if (!smem_get(mempool, &objnr, 1))
+			return NULL;
+		return index_to_obj(mempool, objnr);
+	}
+	smem_mag_lock(mag);
+	if (!mag->avail) {
+		mag->avail = smem_get(mempool, mag->entry, MAGAZINE_BATCH);
+		if (!mag->avail && smem_magazine_drain(mempool, mag))
+			mag->avail = smem_get(mempool, mag->entry, MAGAZINE_BATCH);
+		if (!mag->avail) {
+			smem_mag_unlock(mag);
+			return NULL;
+		}
+		smem_mark(mempool, mag->entry, mag->avail, SMEM_BUFCTL_CACHED);
+	}
+	objnr = mag->entry[--mag->avail];
+	smem_mark(mempool, &objnr, 1, SMEM_BUFCTL_INUSE);
+	smem_mag_unlock(mag);
+
+	return index_to_obj(mempool, objnr);
+}
+
+static void smem_magazine_free(smempool_t *mempool, smem_bufctl_t objnr)
+{
+	struct smem_magazine *mag;
+
+	mag = smem_magazine(mempool);
+	if (!mag) {
+		smem_put(mempool, &objnr, 1);
+		return;
+	}
+	smem_mag_lock(mag);
+	if (mag->avail == SMEMPOOL_MAGAZINE_SIZE) {
+		/* 归还栈底较冷的一半, 保留最近释放的元素 */
+		smem_put(mempool, mag->entry, MAGAZINE_BATCH);
+		memmove(mag->entry, mag->entry + MAGAZINE_BATCH,
+			(SMEMPOOL_MAGAZINE_SIZE - MAGAZINE_BATCH) * sizeof(smem_bufctl_t));
+		mag->avail -= MAGAZINE_BATCH;
+	}
+	smem_mark(mempool, &objnr, 1, SMEM_BUFCTL_CACHED);
+	mag->entry[mag->avail++] = objnr;
+	smem_mag_unlock(mag);
+}
+
+/*
+ * 可增长模式(MEMPOOL_F_GROW): 创建时的内存用完后, 按slab_size(2的n次方)
+ * 对齐申请新的slab, 每个slab与原内存池布局相同:
+ *
+ *	+------------------------------------------------+
+ *	|          |         |            | |    |        |
+ *	| smem_slab| smempool| smem_bufctl| |ele0|......  |
+ *	|          |         |            | |    |        |
+ *	+------------------------------------------------+
+ *
+ * 释放时用地址与slab_size掩码找到所属slab. slab按kernel slab的方式挂在
+ * partial/full/free三个链表上, free链表中空闲超过idle_ms的slab被释放.
+ * 所有slab共用创建时内存池的锁, 不支持magazine/无锁/共享模式.
+ */
+#define SMEMPOOL_MAGIC	0x534d454dU	/* "SMEM" */
+
+struct smem_slab {
+	struct list_head list;
+	uint64_t idle_since;		/* ms, 进入free链表的时间 */
+	uint32_t backing;		/* MEMPOOL_MEM_*, 同创建时的后备内存方式 */
+	smempool_t pool;
+};
+
+struct smem_grow {
+	struct list_head partial, full, free;
+	uintptr_t *base;		/* 所有slab的起始地址, 升序, 共nr_slabs个 */
+	uint32_t max_slabs;		/* base数组容量 */
+	uint32_t slab_size;
+	uint32_t nr_slabs;
+	uint32_t nr_free;
+	uint32_t inuse;			/* elements in use in chained slabs */
+	uint64_t idle_ms;
+};
+
+#define SMEMPOOL_IDLE_MS	1000
+
+static smempool_t *__smempool_create(void *mem_ptr, uint32_t mem_size, uint32_t element_size, uint32_t align, uint32_t flags);
+
+static inline uint64_t mempool_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int smem_grow_init(smempool_t *mempool)
+{
+	struct smem_grow *grow;
+	size_t need;
+
+	grow = (struct smem_grow *)malloc(sizeof(struct smem_grow));
+	if (!grow)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&grow->partial);
+	INIT_LIST_HEAD(&grow->full);
+	INIT_LIST_HEAD(&grow->free);
+	grow->base = NULL;
+	grow->max_slabs = 0;
+	/* 每个slab至少与原内存池一样大 */
+	need = sizeof(struct smem_slab) + sizeof(smem_bufctl_t) + mempool->ele_asize + mempool->align;
+	if (need < mempool->mem_size)
+		need = mempool->mem_size;
+	grow->slab_size = 1U << (32 - __builtin_clz((uint32_t)need - 1));
+	grow->nr_slabs = 0;
+	grow->nr_free = 0;
+	grow->inuse = 0;
+	grow->idle_ms = SMEMPOOL_IDLE_MS;
+	mempool->grow = grow;
+
+	return 0;
+}
+
+/* 持锁调用, 返回base在slab地址数组中的位置(不存在时为插入位置) */
+static uint32_t smem_slab_index(struct smem_grow *grow, uintptr_t base)
+{
+	uint32_t lo = 0, hi = grow->nr_slabs, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (grow->base[mid] < base)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* 持锁调用, 在nr_slabs增加之前记录新slab的地址 */
+static int smem_slab_index_add(struct smem_grow *grow, struct smem_slab *slab)
+{
+	uintptr_t *base;
+	uint32_t pos;
+
+	if (grow->nr_slabs == grow->max_slabs) {
+		base = (uintptr_t *)realloc(grow->base, (grow->max_slabs ? grow->max_slabs * 2 : 8) * sizeof(*base));
+		if (!base)
+			return -ENOMEM;
+		grow->base = base;
+		grow->max_slabs = grow->max_slabs ? grow->max_slabs * 2 : 8;
+	}
+	pos = smem_slab_index(grow, (uintptr_t)slab);
+	memmove(&grow->base[pos + 1], &grow->base[pos], (grow->nr_slabs - pos) * sizeof(*grow->base));
+	grow->base[pos] = (uintptr_t)slab;
+	return 0;
+}
+
+/* 持锁调用, 在nr_slabs减少之前删除slab的地址 */
+static void smem_slab_index_del(struct smem_grow *grow, struct smem_slab *slab)
+{
+	uint32_t pos = smem_slab_index(grow, (uintptr_t)slab);
+
+	memmove(&grow->base[pos], &grow->base[pos + 1], (grow->nr_slabs - pos - 1) * sizeof(*grow->base));
+}
+
+static struct smem_slab *smem_slab_new(smempool_t *mempool)
+{
+	struct smem_grow *grow = mempool->grow;
+	struct smem_slab *slab;
+	uint32_t backing;
+	void *mem;
+
+	mem = mempool_region_alloc_aligned(grow->slab_size, grow->slab_size, mempool->flags, &backing);
+	if (!mem)
+		return NULL;
+	slab = (struct smem_slab *)mem;
+	slab->backing = backing;
+	if (!__smempool_create(&slab->pool, grow->slab_size - offsetof(struct smem_slab, pool),
+			mempool->ele_ssize, mempool->align, MEMPOOL_F_LOCK(MEMPOOL_LOCK_NONE) |
+			(mempool->flags & (MEMPOOL_F_HWCACHE_ALIGN | MEMPOOL_F_COLOR | MEMPOOL_F_BITMAP | MEMPOOL_F_DEBUG))) ||
+	    smem_slab_index_add(grow, slab)) {
+		mempool_region_free(mem, grow->slab_size, backing);
+		return NULL;
+	}
+	grow->nr_slabs++;
+	pr_debug("new slab=%p, slab_size=%u, nr_slabs=%u\n", slab, grow->slab_size, grow->nr_slabs);
+
+	return slab;
+}
+
+/*
+ * 持锁调用, 找到objp所属的slab, 不属于任何slab时返回NULL.
+ * slab按slab_size对齐, 先在地址数组中确认, 不读取未知地址的内容
+ */
+static inline struct smem_slab *smem_slab_lookup(smempool_t *mempool, void *objp)
+{
+	struct smem_grow *grow = mempool->grow;
+	uintptr_t base;
+	uint32_t pos;
+
+	if ((uintptr_t)objp - (uintptr_t)mempool < mempool->mem_size)
+		return NULL;
+	base = (uintptr_t)objp & ~(uintptr_t)(grow->slab_size - 1);
+	pos = smem_slab_index(grow, base);
+	if (pos == grow->nr_slabs || grow->base[pos] != base)
+		return NULL;
+	return (struct smem_slab *)base;
+}
+
+/* 持锁调用, 将free链表中空闲超过idle_ms(force时不论时间)的slab摘到reap中 */
+static void smem_slab_reap(smempool_t *mempool, struct list_head *reap, int force)
+{
+	struct smem_grow *grow = mempool->grow;
+	struct smem_slab *slab, *n;
+	uint64_t now = mempool_now_ms();
+
+	list_for_each_entry_safe(slab, n, &grow->free, list) {
+		/* free链表按进入时间排序 */
+		if (!force && now - slab->idle_since < grow->idle_ms)
+			break;
+		list_move(&slab->list, reap);
+		smem_slab_index_del(grow, slab);
+		grow->nr_free--;
+		grow->nr_slabs--;
+	}
+}
+
+/* 锁外释放摘下的slab */
+static void smem_slab_reap_free(smempool_t *mempool, struct list_head *reap)
+{
+	struct smem_slab *slab, *n;
+
+	list_for_each_entry_safe(slab, n, reap, list) {
+		list_del(&slab->list);
+		pr_debug("release slab=%p\n", slab);
+		mempool_anno_undefined(slab, mempool->grow->slab_size);
+		mempool_region_free(slab, mempool->grow->slab_size, slab->backing);
+	}
+}
+
+static void *smem_grow_alloc(smempool_t *mempool)
+{
+	struct smem_grow *grow = mempool->grow;
+	struct smem_slab *slab;
+	smem_bufctl_t objnr;
+	void *objp = NULL;
+
+	pool_lock(mempool);
+	if (__smem_get(mempool, &objnr, 1)) {
+		objp = index_to_obj(mempool, objnr);
+		goto out;
+	}
+	if (!list_empty(&grow->partial)) {
+		slab = list_first_entry(&grow->partial, struct smem_slab, list);
+	} else if (!list_empty(&grow->free)) {
+		/* 取最近变空的slab, 较早的继续老化 */
+		slab = list_last_entry(&grow->free, struct smem_slab, list);
+		list_move(&slab->list, &grow->partial);
+		grow->nr_free--;
+	} else {
+		slab = smem_slab_new(mempool);
+		if (!slab)
+			goto out;
+		list_add(&slab->list, &grow->partial);
+	}
+	__smem_get(&slab->pool, &objnr, 1);
+	__atomic_store_n(&grow->inuse, grow->inuse + 1, __ATOMIC_RELAXED);
+	if (slab->pool.inuse == slab->pool.ele_num)
+		list_move(&slab->list, &grow->full);
+	objp = index_to_obj(&slab->pool, objnr);
+out:
+	pool_unlock(mempool);
+
+	return objp;
+}
+
+/*
+ * 返回0表示objp属于某个slab并已释放, -ENOENT表示objp在原内存池中,
+ * 不属于任何slab的地址返回-EINVAL
+ */
+static int smem_grow_free(smempool_t *mempool, void *objp)
+{
+	struct smem_grow *grow = mempool->grow;
+	struct smem_slab *slab;
+	smem_bufctl_t objnr;
+	LIST_HEAD(reap);
+
+	if ((uintptr_t)objp - (uintptr_t)mempool < mempool->mem_size)
+		return -ENOENT;
+	pool_lock(mempool);
+	slab = smem_slab_lookup(mempool, objp);
+	if (!slab) {
+		pool_unlock(mempool);
+		return -EINVAL;
+	}
+	objnr = obj_to_index(&slab->pool, objp);
+	if ((char *)objp < (char *)smem_base(&slab->pool) || objnr >= slab->pool.ele_num ||
+	    smem_obj_is_free(&slab->pool, objnr)) {
+		pool_unlock(mempool);
+		return -EINVAL;
+	}
+	smem_anno_free(mempool, objp);
+	if (slab->pool.inuse == slab->pool.ele_num)
+		list_move(&slab->list, &grow->partial);
+	__smem_put(&slab->pool, &objnr, 1);
+	__atomic_store_n(&grow->inuse, grow->inuse - 1, __ATOMIC_RELAXED);
+	if (!slab->pool.inuse) {
+		slab->idle_since = mempool_now_ms();
+		list_move_tail(&slab->list, &grow->free);
+		grow->nr_free++;
+		smem_slab_reap(mempool, &reap, 0);
+	}
+	pool_unlock(mempool);
+	smem_slab_reap_free(mempool, &reap);
+
+	return 0;
+}
+
+static void smem_grow_destroy(smempool_t *mempool)
+{
+	struct smem_grow *grow = mempool->grow;
+	LIST_HEAD(all);
+
+	list_splice_init(&grow->partial, &all);
+	list_splice_init(&grow->full, &all);
+	list_splice_init(&grow->free, &all);
+	smem_slab_reap_free(mempool, &all);
+	free(grow->base);
+	free(grow);
+	mempool->grow = NULL;
+}
+
+/*
+ * 远程释放模式: 只有owner线程分配, owner的分配/释放直接操作空闲链表, 不加锁.
+ * 其他线程释放的元素用CAS压入remote栈(通过bufctl链接), owner在空闲链表
+ * 用完时一次取走整个栈. 消费者只做整体exchange, 不会有ABA问题.
+ */
+#define SMEM_REMOTE_END(mempool)	((mempool)->ele_num)
+
+static inline int smem_is_owner(smempool_t *mempool)
+{
+	return pthread_equal(pthread_self(), mempool->owner);
+}
+
+/* remote栈头被所有释放线程CAS, 单独占一个cacheline, 避免与头部其他字段伪共享 */
+static int smem_remote_init(smempool_t *mempool)
+{
+	if (posix_memalign((void **)&mempool->remote, MEMPOOL_CACHE_LINE, MEMPOOL_CACHE_LINE))
+		return -ENOMEM;
+	*mempool->remote = SMEM_REMOTE_END(mempool);
+	return 0;
+}
+
+/* 非owner线程释放n个元素 */
+static void smem_remote_put(smempool_t *mempool, smem_bufctl_t *objnr, uint32_t n)
+{
+	smem_bufctl_t old;
+	uint32_t i;
+
+	if (!n)
+		return;
+	for (i = 0; i < n - 1; i++)
+		__atomic_store_n(&smem_bufctl(mempool)[objnr[i]], objnr[i+1], __ATOMIC_RELAXED);
+	old = __atomic_load_n(mempool->remote, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&smem_bufctl(mempool)[objnr[n-1]], old, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(mempool->remote, &old, objnr[0], 1,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* owner取走remote栈, 挂到空闲链表, 返回取回的个数 */
+static uint32_t smem_remote_drain(smempool_t *mempool)
+{
+	smem_bufctl_t idx, next;
+	uint32_t n = 0;
+
+	if (__atomic_load_n(mempool->remote, __ATOMIC_RELAXED) == SMEM_REMOTE_END(mempool))
+		return 0;
+	idx = __atomic_exchange_n(mempool->remote, SMEM_REMOTE_END(mempool), __ATOMIC_ACQUIRE);
+	while (idx != SMEM_REMOTE_END(mempool)) {
+		next = __atomic_load_n(&smem_bufctl(mempool)[idx], __ATOMIC_RELAXED);
+		smem_bufctl(mempool)[idx] = mempool->free;
+		mempool->free = idx;
+		idx = next;
+		n++;
+	}
+	__atomic_store_n(&mempool->inuse, mempool->inuse - n, __ATOMIC_RELAXED);
+	pr_debug("drain %u remote frees\n", n);
+
+	return n;
+}
+
+/* owner分配最多n个元素 */
+static uint32_t smem_remote_get(smempool_t *mempool, smem_bufctl_t *objnr, uint32_t n)
+{
+	uint32_t got;
+
+	if (!smem_is_owner(mempool)) {
+		pr_wrn("MEMPOOL_F_REMOTE_FREE: alloc from non-owner thread\n");
+		return 0;
+	}
+	got = __smem_get(mempool, objnr, n);
+	if (got < n && smem_remote_drain(mempool))
+		got += __smem_get(mempool, objnr + got, n - got);
+	return got;
+}
+
+/*
+ * MEMPOOL_F_REMOTE_FREE: 调用线程成为owner, 之后只有它可以分配.
+ * 用于把内存池交给另一个线程, 调用者需保证原owner已经不再使用,
+ * 并在通知其他线程之前调用(例如在创建工作线程之前)
+ */
+int smempool_set_owner(smempool_t *mempool)
+{
+	if (!mempool || !(mempool->flags & MEMPOOL_F_REMOTE_FREE))
+		return -EINVAL;
+	mempool->owner = pthread_self();
+	return 0;
+}
+
+/*
+ * 设置空slab的保留时间, 0表示变空后立即释放
+ */
+int smempool_set_idle(smempool_t *mempool, uint32_t idle_ms)
+{
+	if (!mempool || !mempool->grow)
+		return -EINVAL;
+	pool_lock(mempool);
+	mempool->grow->idle_ms = idle_ms;
+	pool_unlock(mempool);
+	return 0;
+}
+
+/*
+ * 立即释放所有空slab, 返回释放的个数
+ */
+uint32_t smempool_shrink(smempool_t *mempool)
+{
+	uint32_t nr;
+	LIST_HEAD(reap);
+
+	if (!mempool || !mempool->grow)
+		return 0;
+	pool_lock(mempool);
+	nr = mempool->grow->nr_free;
+	smem_slab_reap(mempool, &reap, 1);
+	pool_unlock(mempool);
+	smem_slab_reap_free(mempool, &reap);
+
+	return nr;
+}
+
+/*
+ * 持有/释放内存池的锁(包括grow模式的所有slab), 用于pthread_atfork:
+ * fork前取得锁, 子进程中的内存池就不会停在其他线程的临界区中间
+ */
+void smempool_lock(smempool_t *mempool)
+{
+	if (mempool)
+		mempool_lock(&mempool->lock);
+}
+
+void smempool_unlock(smempool_t *mempool)
+{
+	if (mempool)
+		mempool_unlock(&mempool->lock);
+}
+
+/*
+ * 指定大小为size的内存池
+ *
+ *	+--------------------------------------+
+ *      |         |            | |    |        |
+ *      | smempool| smem_bufctl| |ele0|......  |
+ *      |         |            | |    |        |
+ *	+--------------------------------------+
+ *
+ * 头部只保存相对偏移, 空闲链表也是下标, 整块内存与映射地址无关.
+ * MEMPOOL_F_SHARED: 内存放在shm_open/memfd段中, 多个进程分别映射后
+ * 用smempool_attach()接入, 锁以进程共享方式初始化(或使用无锁链表头).
+ * magazine和统计依赖进程私有数据, 共享模式下不支持.
+ * 接入的进程用smempool_detach()退出, 所有进程退出后由创建者smempool_destroy().
+ */
+
+/* 不小于该值的2的n次方步长在MEMPOOL_F_COLOR时加一个cacheline */
+#define SMEM_COLOR_PAD_MIN	512
+
+static uint32_t smem_color_next;
+
+/*
+ * MEMPOOL_F_HWCACHE_ALIGN/MEMPOOL_F_COLOR的布局: 元素区起始按align对齐到
+ * 绝对地址(而不只是相对内存池头部), bufctl与元素区之间的剩余空间按
+ * cacheline(align更大时按align)划分为若干颜色. MEMPOOL_F_COLOR时每个新的
+ * 内存池/slab依次使用下一个颜色, 不同slab中相同下标的元素落在不同的
+ * cache组中, 同内核slab的colour_off.
+ */
+static void smem_layout_color(smempool_t *mempool, uint32_t flags)
+{
+	uintptr_t base = (uintptr_t)mempool;
+	uintptr_t end = base + mempool->mem_size;
+	uintptr_t start, bufctl_end;
+	uint32_t step, ncolor, color;
+
+	for (;;) {
+		start = (end - (uintptr_t)mempool->ele_num * mempool->ele_asize) & ~((uintptr_t)mempool->align - 1);
+		bufctl_end = base + sizeof(smempool_t) + smem_meta_size(flags, mempool->ele_num);
+		if (start >= bufctl_end || !mempool->ele_num)
+			break;
+		mempool->ele_num--;
+	}
+	if ((flags & MEMPOOL_F_COLOR) && start >= bufctl_end) {
+		step = mempool->align > MEMPOOL_CACHE_LINE ? mempool->align : MEMPOOL_CACHE_LINE;
+		ncolor = (start - bufctl_end) / step + 1;
+		color = __atomic_fetch_add(&smem_color_next, 1, __ATOMIC_RELAXED) % ncolor;
+		start -= (uintptr_t)color * step;
+		pr_debug("color=%u/%u, step=%u\n", color, ncolor, step);
+	}
+	mempool->smem_off = start - base;
+}
+
+static smempool_t *__smempool_create(void *mem_ptr, uint32_t mem_size, uint32_t element_size, uint32_t align, uint32_t flags)
+{
+	smempool_t *mempool;
+	int i;
+
+	mempool = (smempool_t *)mem_ptr;
+	mempool->magic = 0;
+	mempool->backing = MEMPOOL_MEM_EXTERNAL;
+	mempool->grow = NULL;
+	mempool_lock_init(&mempool->lock, MEMPOOL_LOCK_TYPE(flags), flags & MEMPOOL_F_SHARED);
+	mempool->mem_size = mem_size;
+	mempool->align = (!align) ? ALIGN_SIZE : align;
+	if ((flags & MEMPOOL_F_HWCACHE_ALIGN) && mempool->align < MEMPOOL_CACHE_LINE)
+		mempool->align = MEMPOOL_CACHE_LINE;
+	mempool->ele_ssize = element_size;
+	/* MEMPOOL_F_DEBUG: 元素之后紧接red zone */
+	mempool->ele_asize = ALIGN((element_size + ((flags & MEMPOOL_F_DEBUG) ? MEMPOOL_REDZONE : 0)), mempool->align);
+	/* 2的n次方步长的元素只落在少数几个L1组中, 多加一个cacheline错开 */
+	if ((flags & MEMPOOL_F_COLOR) && mempool->align <= MEMPOOL_CACHE_LINE &&
+	    mempool->ele_asize >= SMEM_COLOR_PAD_MIN && !(mempool->ele_asize & (mempool->ele_asize - 1)))
+		mempool->ele_asize += MEMPOOL_CACHE_LINE;
+	mempool->ele_recip = reciprocal_value(mempool->ele_asize);
+	if (flags & MEMPOOL_F_BITMAP) {
+		/* 每个元素ele_asize字节加1位 */
+		mempool->ele_num = ((uint64_t)(mempool->mem_size-sizeof(smempool_t)) * 8) / ((uint64_t)mempool->ele_asize * 8 + 1);
+		while (mempool->ele_num && sizeof(smempool_t) + smem_meta_size(flags, mempool->ele_num) +
+		       (size_t)mempool->ele_num * mempool->ele_asize > mempool->mem_size)
+			mempool->ele_num--;
+	} else
+		mempool->ele_num = (mempool->mem_size-sizeof(smempool_t))/(sizeof(smem_bufctl_t)+mempool->ele_asize);
+	if (flags & (MEMPOOL_F_HWCACHE_ALIGN | MEMPOOL_F_COLOR))
+		smem_layout_color(mempool, flags);
+	else
+		mempool->smem_off = mempool->mem_size-(mempool->ele_num*mempool->ele_asize);
+	mempool->free = 0;
+	mempool->inuse = 0;
+	mempool->head = LF_HEAD(0, 0);
+	mempool->owner = pthread_self();
+	mempool->remote = NULL;
+	mempool->flags = flags;
+	mempool->creator = getpid();
+	mempool->stats = NULL;
+	mempool->quarantine = NULL;
+	mempool->bm_levels = 0;
+	if (flags & MEMPOOL_F_BITMAP)
+		smem_bm_init(mempool);
+	else {
+		for (i=0;i<mempool->ele_num;i++)
+			smem_bufctl(mempool)[i]=i+1;
+	}
+	if (flags & MEMPOOL_F_DEBUG) {
+		for (i=0;i<mempool->ele_num;i++) {
+			mempool_poison(index_to_obj(mempool, i), element_size);
+			mempool_redzone_set((char *)index_to_obj(mempool, i) + element_size, RED_INACTIVE);
+		}
+	}
+	if (!(flags & MEMPOOL_F_SHARED))
+		mempool_anno_noaccess(smem_base(mempool), (size_t)mempool->ele_num * mempool->ele_asize);
+
+	INIT_LIST_HEAD(&mempool->magazines);
+
+#ifdef DEBUG
+#if 1
+	dump_mempool(mempool, smem_off, "%u");
+	dump_mempool(mempool, mem_size, "%u");
+	dump_mempool(mempool, align, "%u");
+	dump_mempool(mempool, ele_ssize, "%u");
+	dump_mempool(mempool, ele_asize, "%u");
+	dump_mempool(mempool, ele_num, "%u");
+	dump_mempool(mempool, flags, "0x%x");
+#endif
+#endif
+	/* 其他进程看到magic时, 头部已经初始化完成 */
+	__atomic_store_n(&mempool->magic, SMEMPOOL_MAGIC, __ATOMIC_RELEASE);
+
+	return mempool;
+}
+
+smempool_t *smempool_create_ex(void *mem_ptr, uint32_t mem_size, uint32_t element_size, uint32_t align, uint32_t flags)
+{
+	uint32_t backing = MEMPOOL_MEM_EXTERNAL;
+	smempool_t *mempool;
+
+	if (!mem_size || mem_size <= sizeof(smempool_t))
+		return NULL;
+	if ((flags & MEMPOOL_F_SHARED) && (flags & (MEMPOOL_F_MAGAZINE | MEMPOOL_F_STATS | MEMPOOL_F_GROW))) {
+		pr_wrn("MEMPOOL_F_SHARED can not be used with magazine/stats/grow, flags=0x%x\n", flags);
+		return NULL;
+	}
+	if ((flags & MEMPOOL_F_GROW) && (flags & (MEMPOOL_F_MAGAZINE | MEMPOOL_F_LOCKFREE))) {
+		pr_wrn("MEMPOOL_F_GROW can not be used with magazine/lockfree, flags=0x%x\n", flags);
+		return NULL;
+	}
+	if ((flags & MEMPOOL_F_REMOTE_FREE) &&
+	    (flags & (MEMPOOL_F_MAGAZINE | MEMPOOL_F_LOCKFREE | MEMPOOL_F_GROW | MEMPOOL_F_SHARED))) {
+		pr_wrn("MEMPOOL_F_REMOTE_FREE can not be used with magazine/lockfree/grow/shared, flags=0x%x\n", flags);
+		return NULL;
+	}
+	/* 位图只在锁内更新, magazine中的元素在位图中仍为使用中, 无法检查重复释放 */
+	if ((flags & MEMPOOL_F_BITMAP) && (flags & (MEMPOOL_F_MAGAZINE | MEMPOOL_F_LOCKFREE | MEMPOOL_F_REMOTE_FREE))) {
+		pr_wrn("MEMPOOL_F_BITMAP can not be used with magazine/lockfree/remote free, flags=0x%x\n", flags);
+		return NULL;
+	}
+	/* 隔离区在进程私有内存中, 由内存池的锁保护 */
+	if ((flags & MEMPOOL_F_DEBUG) && (flags & (MEMPOOL_F_SHARED | MEMPOOL_F_REMOTE_FREE))) {
+		pr_wrn("MEMPOOL_F_DEBUG can not be used with shared/remote free, flags=0x%x\n", flags);
+		return NULL;
+	}
+	if (!mem_ptr) {
+		mem_ptr = mempool_region_alloc(mem_size, flags, &backing);
+		if (!mem_ptr)
+			return NULL;
+	}
+
+	mempool = __smempool_create(mem_ptr, mem_size, element_size, align, flags);
+	mempool->backing = backing;
+	mempool_anno_create(mempool);
+	mempool->stats = mempool_stats_create(flags);
+	mempool->quarantine = mempool_quarantine_create(flags, 0);
+	if ((flags & MEMPOOL_F_REMOTE_FREE) && smem_remote_init(mempool)) {
+		smempool_destroy(mempool);
+		return NULL;
+	}
+	if ((flags & MEMPOOL_F_GROW) && smem_grow_init(mempool)) {
+		smempool_destroy(mempool);
+		return NULL;
+	}
+	if (flags & MEMPOOL_F_MAGAZINE) {
+		if (pthread_key_create(&mempool->mag_key, smem_magazine_release) != 0)
+			mempool->flags &= ~MEMPOOL_F_MAGAZINE;
+	}
+
+	return mempool;
+}
+
+/*
+ * 其他进程接入已经由smempool_create_ex(..., MEMPOOL_F_SHARED)创建的内存池,
+ * mem_ptr为本进程映射的地址, 可以与创建者不同
+ */
+smempool_t *smempool_attach(void *mem_ptr, uint32_t mem_size)
+{
+	smempool_t *mempool = (smempool_t *)mem_ptr;
+
+	if (!mempool || mem_size <= sizeof(smempool_t))
+		return NULL;
+	if (__atomic_load_n(&mempool->magic, __ATOMIC_ACQUIRE) != SMEMPOOL_MAGIC ||
+	    !(mempool->flags & MEMPOOL_F_SHARED) || mempool->mem_size != mem_size) {
+		pr_wrn("not a shared smempool, mem=%p, mem_size=%u\n", mem_ptr, mem_size);
+		return NULL;
+	}
+
+	return mempool;
+}
+
+/*
+ * 接入的进程退出共享内存池, 不改变共享的头部和锁.
+ * 内存由创建者映射(fork继承)时解除本进程的映射, 调用者自己映射的(MEMPOOL_MEM_EXTERNAL)
+ * 由调用者munmap. 创建者用smempool_destroy()
+ */
+int smempool_detach(smempool_t *mempool)
+{
+	if (!mempool || !(mempool->flags & MEMPOOL_F_SHARED))
+		return -EINVAL;
+	if (mempool->creator == getpid())
+		return -EPERM;
+	mempool_region_free(mempool, mempool->mem_size, mempool->backing);
+	return 0;
+}
+
+/*
+ * 元素与池内偏移互换, 偏移可以在映射地址不同的进程间传递
+ */
+uint32_t smempool_ptr2off(smempool_t *mempool, void *objp)
+{
+	return (uint32_t)((char *)objp - (char *)mempool);
+}
+
+void *smempool_off2ptr(smempool_t *mempool, uint32_t offset)
+{
+	return (char *)mempool + offset;
+}
+
+/*
+ * 校验obj_to_index: 元素区内每个字节偏移的结果都与除法一致, 返回0表示正确
+ */
+int smempool_verify_index(smempool_t *mempool)
+{
+	uint32_t off, end, idx;
+
+	if (!mempool)
+		return -EINVAL;
+	end = mempool->ele_num * mempool->ele_asize;
+	for (off = 0; off < end; off++) {
+		idx = obj_to_index(mempool, (char *)smem_base(mempool) + off);
+		if (idx != off / mempool->ele_asize) {
+			pr_emerg("ele_asize=%u, offset=%u, index=%u, expect=%u\n",
+				mempool->ele_asize, off, idx, off / mempool->ele_asize);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+smempool_t *smempool_create(void *mem_ptr, uint32_t mem_size, uint32_t element_size, uint32_t align)
+{
+	return smempool_create_ex(mem_ptr, mem_size, element_size, align, 0);
+}
+
+void smempool_destroy(smempool_t *mempool)
+{
+	struct smem_magazine *mag, *n;
+
+	if (!mempool)
+		return ;
+	if ((mempool->flags & MEMPOOL_F_SHARED) && mempool->creator != getpid()) {
+		pr_wrn("shared smempool=%p not created by this process, use smempool_detach\n", mempool);
+		return ;
+	}
+	mempool->magic = 0;
+	mempool_anno_destroy(mempool);
+	if (mempool->grow)
+		smem_grow_destroy(mempool);
+	if (mempool->flags & MEMPOOL_F_MAGAZINE) {
+		pthread_key_delete(mempool->mag_key);
+		list_for_each_entry_safe(mag, n, &mempool->magazines, list) {
+			list_del(&mag->list);
+			free(mag);
+		}
+	}
+	mempool_lock_destroy(&mempool->lock);
+	free(mempool->stats);
+	free(mempool->quarantine);
+	free(mempool->remote);
+	mempool_anno_undefined(mempool, mempool->mem_size);
+	mempool_region_free(mempool, mempool->mem_size, mempool->backing);
+}
+
+static inline uint32_t smem_inuse(smempool_t *mempool)
+{
+	uint32_t inuse = __atomic_load_n(&mempool->inuse, __ATOMIC_RELAXED);
+
+	if (mempool->grow)
+		inuse += __atomic_load_n(&mempool->grow->inuse, __ATOMIC_RELAXED);
+	return inuse;
+}
+
+/*
+ * 统计快照, inuse包含线程magazine中缓存的元素
+ */
+int smempool_get_stats(smempool_t *mempool, mempool_stats_t *st)
+{
+	if (!mempool || !st)
+		return -EINVAL;
+	/* owner先取回remote栈, 其他线程看到的inuse可能偏大 */
+	if ((mempool->flags & MEMPOOL_F_REMOTE_FREE) && smem_is_owner(mempool))
+		smem_remote_drain(mempool);
+	mempool_stats_snapshot(mempool->stats, st);
+	st->inuse = smem_inuse(mempool);
+	return mempool->stats ? 0 : -ENOENT;
+}
+
+static inline void smem_stat_alloc(smempool_t *mempool, uint32_t got, uint32_t want)
+{
+	if (!mempool->stats)
+		return;
+	mempool_stat_add(mempool->stats, allocs, got);
+	if (got < want)
+		mempool_stat_add(mempool->stats, failures, want - got);
+	mempool_stat_high_water(mempool->stats, smem_inuse(mempool));
+}
+
+/* MEMPOOL_F_DEBUG: 分配出去前检查red zone, 空闲期间被改写说明相邻元素越界 */
+static void smem_debug_alloc(smempool_t *mempool, void *objp)
+{
+	void *rz = (char *)objp + mempool->ele_ssize;
+
+	if (mempool_redzone_get(rz) != RED_INACTIVE)
+		mempool_report(mempool->stats, "smempool", mempool, objp, "red zone of free object overwritten");
+	mempool_redzone_set(rz, RED_ACTIVE);
+}
+
+/*
+ * MEMPOOL_F_DEBUG: 检查并隔离objp, 返回需要真正释放的对象(隔离区挤出的),
+ * 没有或者objp有问题时返回NULL
+ */
+static void *smem_debug_free(smempool_t *mempool, void *objp)
+{
+	smempool_t *pool = mempool;
+	struct smem_slab *slab;
+	uint32_t objnr;
+	uint64_t red;
+	void *rz;
+
+	if (mempool->grow) {
+		pool_lock(mempool);
+		slab = smem_slab_lookup(mempool, objp);
+		pool_unlock(mempool);
+		if (slab)
+			pool = &slab->pool;
+	}
+	objnr = obj_to_index(pool, objp);
+	if ((char *)objp < (char *)smem_base(pool) || objnr >= pool->ele_num || index_to_obj(pool, objnr) != objp) {
+		mempool_report(mempool->stats, "smempool", mempool, objp, "invalid free");
+		return NULL;
+	}
+	rz = (char *)objp + mempool->ele_ssize;
+	red = mempool_redzone_get(rz);
+	if (red == RED_INACTIVE) {
+		mempool_report(mempool->stats, "smempool", mempool, objp, "double free");
+		return NULL;
+	}
+	if (red != RED_ACTIVE) {
+		mempool_report(mempool->stats, "smempool", mempool, objp, "red zone overwritten (buffer overflow)");
+		return NULL;
+	}
+	mempool_redzone_set(rz, RED_INACTIVE);
+	if (!mempool_debug_sampled(mempool->flags))
+		return objp;
+	mempool_poison(objp, mempool->ele_ssize);
+	mempool_anno_noaccess(objp, mempool->ele_ssize);
+	if (!mempool->quarantine)
+		return objp;
+	pool_lock(mempool);
+	mempool_quarantine_push(mempool->quarantine, objp, mempool->ele_ssize);
+	objp = mempool_quarantine_pop(mempool->quarantine);
+	pool_unlock(mempool);
+	if (objp && mempool_poison_check(objp, mempool->ele_ssize))
+		mempool_report(mempool->stats, "smempool", mempool, objp, "use after free (poison overwritten)");
+
+	return objp;
+}
+
+void *smempool_alloc(smempool_t *mempool)
+{
+	void *objp;
+	smem_bufctl_t objnr;
+
+	if (!mempool)
+		return NULL;
+	if (mempool->flags & MEMPOOL_F_MAGAZINE)
+		objp = smem_magazine_alloc(mempool);
+	else if (mempool->flags & MEMPOOL_F_REMOTE_FREE)
+		objp = smem_remote_get(mempool, &objnr, 1) ? index_to_obj(mempool, objnr) : NULL;
+	else if (mempool->grow)
+		objp = smem_grow_alloc(mempool);
+	else if (__atomic_load_n(&mempool->inuse, __ATOMIC_RELAXED) == mempool->ele_num)
+		objp = NULL;
+	else if (!smem_get(mempool, &objnr, 1))
+		objp = NULL;
+	else
+		objp = index_to_obj(mempool, objnr);
+	if (objp && (mempool->flags & MEMPOOL_F_DEBUG))
+		smem_debug_alloc(mempool, objp);
+	if (objp)
+		smem_anno_alloc(mempool, objp);
+	smem_stat_alloc(mempool, objp != NULL, 1);
+	pr_debug("inuse=%u,free=%u,objp=%p\n", mempool->inuse, mempool->free, objp);
+
+	return objp;
+}
+
+void smempool_free(smempool_t *mempool, void *objp)
+{
+	smem_bufctl_t objnr;
+	int err;
+
+	if (!objp)
+		return;
+	if (mempool->flags & MEMPOOL_F_DEBUG) {
+		objp = smem_debug_free(mempool, objp);
+		if (!objp)
+			return;
+	}
+
+	if (mempool->grow && (err = smem_grow_free(mempool, objp)) != -ENOENT) {
+		if (!err)
+			mempool_stat_add(mempool->stats, frees, 1);
+		return ;
+	}
+	objnr = obj_to_index(mempool, objp);
+	if (!(mempool->flags & (MEMPOOL_F_MAGAZINE | MEMPOOL_F_LOCKFREE | MEMPOOL_F_REMOTE_FREE))) {
+		if (smem_put_checked(mempool, &objnr, 1))
+			mempool_stat_add(mempool->stats, frees, 1);
+		pr_debug("inuse=%u,free=%u,objp=%p,objnr=%u\n",
+			mempool->inuse, mempool->free, objp, objnr);
+		return ;
+	}
+	if (!smem_obj_claim(mempool, objnr))
+		return ;
+	smem_anno_free(mempool, objp);
+	mempool_stat_add(mempool->stats, frees, 1);
+	if (mempool->flags & MEMPOOL_F_MAGAZINE) {
+		smem_magazine_free(mempool, objnr);
+		return ;
+	}
+	if (mempool->flags & MEMPOOL_F_REMOTE_FREE) {
+		if (smem_is_owner(mempool))
+			__smem_put(mempool, &objnr, 1);
+		else
+			smem_remote_put(mempool, &objnr, 1);
+		return ;
+	}
+	smem_lf_put(mempool, &objnr, 1);
+	return ;
+}
+
+
+#define SMEM_BULK_BATCH	64
+
+/*
+ * 一次加锁分配最多n个元素, 返回实际分配的个数
+ */
+uint32_t smempool_alloc_bulk(smempool_t *mempool, void **objs, uint32_t n)
+{
+	smem_bufctl_t objnr[SMEM_BULK_BATCH];
+	uint32_t i, got, total = 0;
+
+	if (!mempool || !objs)
+		return 0;
+	if (mempool->grow) {
+		/* 可增长模式逐个分配, 内存用完时会链接新slab */
+		for (total = 0; total < n; total++) {
+			objs[total] = smem_grow_alloc(mempool);
+			if (!objs[total])
+				break;
+			if (mempool->flags & MEMPOOL_F_DEBUG)
+				smem_debug_alloc(mempool, objs[total]);
+			smem_anno_alloc(mempool, objs[total]);
+		}
+		smem_stat_alloc(mempool, total, n);
+		return total;
+	}
+	while (total < n) {
+		if (mempool->flags & MEMPOOL_F_REMOTE_FREE)
+			got = smem_remote_get(mempool, objnr, min_t(uint32_t, n - total, SMEM_BULK_BATCH));
+		else
+			got = smem_get(mempool, objnr, min_t(uint32_t, n - total, SMEM_BULK_BATCH));
+		for (i = 0; i < got; i++) {
+			objs[total] = index_to_obj(mempool, objnr[i]);
+			if (mempool->flags & MEMPOOL_F_DEBUG)
+				smem_debug_alloc(mempool, objs[total]);
+			smem_anno_alloc(mempool, objs[total]);
+			total++;
+		}
+		if (got < SMEM_BULK_BATCH)
+			break;
+	}
+	smem_stat_alloc(mempool, total, n);
+	pr_debug("n=%u,total=%u,inuse=%u\n", n, total, mempool->inuse);
+
+	return total;
+}
+
+/* 归还一批元素, 返回实际释放的个数 */
+static inline uint32_t smem_free_batch(smempool_t *mempool,
+		void (*put)(smempool_t *, smem_bufctl_t *, uint32_t), smem_bufctl_t *objnr, uint32_t n)
+{
+	if (!put)
+		return smem_put_checked(mempool, objnr, n);
+	put(mempool, objnr, n);
+	return n;
+}
+
+/*
+ * 一次加锁释放n个元素, magazine模式下直接还给空闲链表
+ */
+void smempool_free_bulk(smempool_t *mempool, void **objs, uint32_t n)
+{
+	smem_bufctl_t objnr[SMEM_BULK_BATCH];
+	void (*put)(smempool_t *, smem_bufctl_t *, uint32_t) = NULL;
+	uint32_t i, cnt = 0, freed = 0;
+	int err;
+
+	if (!mempool || !objs)
+		return;
+	if (mempool->flags & MEMPOOL_F_DEBUG) {
+		/* 逐个检查和隔离 */
+		for (i = 0; i < n; i++)
+			smempool_free(mempool, objs[i]);
+		return;
+	}
+	/* put为NULL时由smem_put_checked在锁内检查重复释放 */
+	if (mempool->flags & MEMPOOL_F_REMOTE_FREE)
+		put = smem_is_owner(mempool) ? __smem_put : smem_remote_put;
+	else if (mempool->flags & MEMPOOL_F_LOCKFREE)
+		put = smem_lf_put;
+	else if (mempool->flags & MEMPOOL_F_MAGAZINE)
+		put = smem_put;		/* 与smempool_free一样用CAS认领, 绕过magazine */
+	for (i = 0; i < n; i++) {
+		if (!objs[i])
+			continue;
+		if (mempool->grow && (err = smem_grow_free(mempool, objs[i])) != -ENOENT) {
+			if (!err)
+				freed++;
+			continue;
+		}
+		objnr[cnt] = obj_to_index(mempool, objs[i]);
+		if (put) {
+			/* 同一批中重复的元素也能被检查出来, put时会覆盖 */
+			if (!smem_obj_claim(mempool, objnr[cnt]))
+				continue;
+			smem_anno_free(mempool, objs[i]);
+		}
+		if (++cnt == SMEM_BULK_BATCH) {
+			freed += smem_free_batch(mempool, put, objnr, cnt);
+			cnt = 0;
+		}
+	}
+	if (cnt)
+		freed += smem_free_batch(mempool, put, objnr, cnt);
+	mempool_stat_add(mempool->stats, frees, freed);
+	pr_debug("n=%u,inuse=%u\n", n, mempool->inuse);
+}
+
+/*
+ * 指定包含大小为size(必须为2的n次方,建议4K以上),size*2^1,size*2^2...size*2^(m-1)
+ * 连续m种大小的内存池
+ *
+ */
+
+#define order2bytes(n) (1<<(n))
+
+#define OVERHEAD (2*sizeof(size_t))
+#define CHUNK_SIZE(c)	((c)->csize & -8)
+#define CHUNK_PSIZE(c)	((c)->psize & -8)
+#define PREV_CHUNK(c)	((struct chunk *)((char *)(c) - CHUNK_PSIZE(c)))
+#define NEXT_CHUNK(c)	((struct chunk *)((char *)(c) + CHUNK_SIZE(c)))
+#define CHUNK_TO_MEM(c) (void *)((char *)(c) + OVERHEAD)
+#define MEM_TO_CHUNK(p) (struct chunk *)((char *)(p) - OVERHEAD)
+
+#define C_INUSE		((size_t)1)
+#define C_LAST		((size_t)2)
+#define C_ALIGNED	((size_t)4)	/* mmempool_alloc_aligned的假头部 */
+
+/*
+ * 对齐分配返回的指针前面是一个假头部: csize = C_ALIGNED|C_INUSE,
+ * psize = 指针到真正chunk起始的偏移
+ */
+static inline struct chunk *mem2chunk(void *objp)
+{
+	struct chunk *c = MEM_TO_CHUNK(objp);
+
+	if (c->csize & C_ALIGNED)
+		c = (struct chunk *)((char *)objp - c->psize);
+	return c;
+}
+
+/*
+ * MEMPOOL_F_OOB: chunk头部不放在内存中, 每个最小order块在oob_map中占一个字节:
+ * 0表示不是chunk的起始块, 否则低7位为chunk的order-order_min+1, OOB_INUSE表示使用中.
+ * 空闲chunk的free_area链表节点在oob_list中, 分配/释放只访问这两张表.
+ * chunk按伙伴方式对齐, 2的n次方大小的请求正好占一个chunk.
+ */
+#define OOB_INUSE	0x80
+#define OOB_IDX(m)	(((m) & 0x7f) - 1)
+#define OOB_SHIFT(mempool)	((mempool)->order_min+10)
+
+static inline size_t mmem_overhead(mmempool_t *mempool)
+{
+	return mempool->oob_map ? 0 : OVERHEAD;
+}
+
+/* MEMPOOL_F_DEBUG时每个对象多出的red zone字节数 */
+static inline uint32_t mmem_redzone(mmempool_t *mempool)
+{
+	return (mempool->flags & MEMPOOL_F_DEBUG) ? MEMPOOL_REDZONE : 0;
+}
+
+static uint32_t mmem_usable_size(mmempool_t *mempool, void *objp);
+
+/* 注解构建: 申请的size字节可访问, 之后到可用空间末尾(含red zone)不可访问 */
+static inline void *mmem_anno_alloc(mmempool_t *mempool, void *objp, uint32_t size)
+{
+	if (objp)
+		mempool_anno_alloc(mempool, objp, size, mmem_usable_size(mempool, objp) - mmem_redzone(mempool));
+	return objp;
+}
+
+static inline void mmem_anno_free(mmempool_t *mempool, void *objp)
+{
+	mempool_anno_free(mempool, objp, mmem_usable_size(mempool, objp) - mmem_redzone(mempool));
+}
+
+/* 实际划分为chunk的内存大小 */
+#define MMEM_END(mempool)	((mempool)->mem_size & ~(order2bytes((mempool)->order_min+10)-1))
+
+/*
+ * 注解构建: 空闲chunk的链表节点在对象原来的位置, 平时不可访问,
+ * 只在链表操作时放开. 链表头和oob_list不在mmem中, 不做标记
+ */
+static inline void free_node_anno(mmempool_t *mempool, struct list_head *node, int access)
+{
+	if ((size_t)((char *)node - (char *)mempool->mmem) >= mempool->mem_size)
+		return;
+	if (access)
+		mempool_anno_defined(node, sizeof(*node));
+	else
+		mempool_anno_noaccess(node, sizeof(*node));
+}
+
+static inline void free_list_add_tail(mmempool_t *mempool, struct list_head *node, struct list_head *head)
+{
+	struct list_head *prev = head->prev;
+
+	free_node_anno(mempool, prev, 1);
+	free_node_anno(mempool, node, 1);
+	list_add_tail(node, head);
+	free_node_anno(mempool, prev, 0);
+	free_node_anno(mempool, node, 0);
+}
+
+static inline void free_list_del(mmempool_t *mempool, struct list_head *node)
+{
+	struct list_head *prev, *next;
+
+	free_node_anno(mempool, node, 1);
+	prev = node->prev;
+	next = node->next;
+	free_node_anno(mempool, prev, 1);
+	free_node_anno(mempool, next, 1);
+	list_del(node);
+	free_node_anno(mempool, prev, 0);
+	free_node_anno(mempool, next, 0);
+	free_node_anno(mempool, node, 0);
+}
+
+/* 遍历空闲链表时取pos的下一个节点 */
+static inline struct list_head *free_list_next(mmempool_t *mempool, struct list_head *pos)
+{
+	struct list_head *next;
+
+	free_node_anno(mempool, pos, 1);
+	next = pos->next;
+	free_node_anno(mempool, pos, 0);
+	return next;
+}
+
+static int mslab_init(mmempool_t *mempool);
+
+mmempool_t *mmempool_create_ex(void *mem_ptr, uint32_t mem_size, uint32_t order_min, uint32_t order_max, uint32_t flags)
+{
+	int free_area_num,i,j;
+	size_t last_size=0, nr_blk;
+	struct chunk *c = NULL;
+	mmempool_t *mempool;
+	char *mmem = NULL;
+
+	if (mem_size == 0 || order_min > order_max || order_max + 10 >= 32)
+		return NULL;
+	if (flags & MEMPOOL_F_OOB)
+		flags |= MEMPOOL_F_BUDDY;
+
+
+	mempool = (mmempool_t *)malloc(sizeof(mmempool_t));
+	if (!mempool)
+		return NULL;
+
+	mempool->flags = flags;
+	mempool_lock_init(&mempool->lock, MEMPOOL_LOCK_TYPE(flags), 0);
+
+	if (!mem_ptr) {
+		mempool->mmem = mempool_region_alloc(mem_size, flags, &mempool->backing);
+/*
+		pr_emerg("LAST->psize=0x%x, LAST->csize=0x%x\n",
+			(uint32_t)((struct chunk *)(mempool->mmem+mem_size))->psize,
+			(uint32_t)((struct chunk *)(mempool->mmem+mem_size))->csize);
+*/
+		if (!mempool->mmem) {
+			free(mempool);
+			return NULL;
+		}
+	} else {
+		mempool->mmem = mem_ptr;
+		mempool->backing = MEMPOOL_MEM_EXTERNAL;
+	}
+	pr_debug("!!!!!!mmem = %p\n", mempool->mmem);
+	/* 注解构建: 只有chunk头部和空闲链表节点可访问 */
+	mempool_anno_create(mempool);
+	mempool_anno_noaccess(mempool->mmem, mem_size);
+	mempool->mem_size = mem_size;
+	mempool->order_max = order_max;
+	mempool->order_min = order_min;
+	mempool->oob_map = NULL;
+	mempool->oob_list = NULL;
+	mempool->slab_map = NULL;
+	mempool->stats = NULL;
+	mempool->quarantine = NULL;
+	if (flags & MEMPOOL_F_OOB) {
+		nr_blk = MMEM_END(mempool) >> OOB_SHIFT(mempool);
+		mempool->oob_map = (uint8_t *)calloc(nr_blk ? nr_blk : 1, 1);
+		mempool->oob_list = (struct list_head *)malloc((nr_blk ? nr_blk : 1) * sizeof(struct list_head));
+	}
+
+	order_max += 10;
+	order_min += 10;
+
+	/* free_area init */
+	free_area_num = order_max-order_min + 1;
+	mempool->free_area = (struct free_area *)malloc(free_area_num * sizeof(struct free_area));
+	pr_debug("!!!!!!free_area= %p\n", mempool->free_area);
+	if (!mempool->free_area || ((flags & MEMPOOL_F_OOB) && (!mempool->oob_map || !mempool->oob_list))) {
+		mmempool_destroy(mempool);
+		return NULL;
+	}
+
+	mmem = mempool->mmem;
+	for (i = 1; i < free_area_num + 1; i++) {
+		struct list_head *head = &mempool->free_area[free_area_num-i].free_list;
+		if (i==1)
+			mempool->free_area[free_area_num-i].nr_free = mem_size>>(order_max+1-i);
+		else
+			mempool->free_area[free_area_num-i].nr_free = (mem_size>>(order_max+1-i))&0x01;
+		INIT_LIST_HEAD(head);
+		pr_debug("order=%u, nr_free=%u\n", order_max+1-i, mempool->free_area[free_area_num-i].nr_free);
+		for (j = 0; j < mempool->free_area[free_area_num-i].nr_free; j++) {
+			if (mempool->oob_map) {
+				nr_blk = (mmem - (char *)mempool->mmem) >> order_min;
+				mempool->oob_map[nr_blk] = free_area_num-i+1;
+				free_list_add_tail(mempool, &mempool->oob_list[nr_blk], head);
+				mmem += order2bytes(order_max+1-i);
+				continue;
+			}
+			c = (struct chunk *)mmem;
+			pr_debug("!!!!!!chunk=%p\n", c);
+			mempool_anno_defined(c, OVERHEAD);
+			c->psize = last_size;
+			c->csize = order2bytes(order_max+1-i);
+			last_size = c->csize;
+			mmem += c->csize;
+			free_list_add_tail(mempool, &c->list, head);
+			pr_debug("psize=%u, csize=%u\n", (uint32_t)c->psize, (uint32_t)c->csize);
+		}
+	}
+	if (c != NULL)
+		c->csize |= C_LAST;
+	mempool->free_map = 0;
+	for (i = 0; i < free_area_num; i++) {
+		if (mempool->free_area[i].nr_free)
+			mempool->free_map |= 1U << i;
+	}
+	mempool->free_bytes = MMEM_END(mempool);
+	mempool->stats = mempool_stats_create(flags);
+	mempool->quarantine = mempool_quarantine_create(flags, mem_size >> MMEMPOOL_QUARANTINE_SHIFT);
+	if ((flags & MEMPOOL_F_SIZE_CLASS) && mslab_init(mempool)) {
+		mmempool_destroy(mempool);
+		return NULL;
+	}
+	return mempool;
+}
+
+mmempool_t *mmempool_create(void *mem_ptr, uint32_t mem_size, uint32_t order_min, uint32_t order_max)
+{
+	return mmempool_create_ex(mem_ptr, mem_size, order_min, order_max, 0);
+}
+
+void mmempool_destroy(mmempool_t *mempool)
+{
+	if (!mempool)
+		return;
+	mempool_anno_destroy(mempool);
+	mempool_anno_undefined(mempool->mmem, mempool->mem_size);
+	mempool_region_free(mempool->mmem, mempool->mem_size, mempool->backing);
+	mempool_lock_destroy(&mempool->lock);
+	free(mempool->free_area);
+	free(mempool->slab_map);
+	free(mempool->oob_map);
+	free(mempool->oob_list);
+	free(mempool->stats);
+	free(mempool->quarantine);
+	free(mempool);
+}
+
+uint32_t mmempool_remain_size(mmempool_t *mempool)
+{
+	if (!mempool)
+		return 0;
+	return __atomic_load_n(&mempool->free_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * 每个对象在chunk中的额外字节数: chunk头部(MEMPOOL_F_OOB时为0)加上
+ * MEMPOOL_F_DEBUG的red zone. 最大的请求为order2bytes(order_max+10)减去此值
+ */
+uint32_t mmempool_overhead(mmempool_t *mempool)
+{
+	if (!mempool)
+		return 0;
+	return mmem_overhead(mempool) + mmem_redzone(mempool);
+}
+
+/*
+ * 统计快照, inuse为不在free_area中的字节数(含size class slab)
+ */
+int mmempool_get_stats(mmempool_t *mempool, mempool_stats_t *st)
+{
+	if (!mempool || !st)
+		return -EINVAL;
+	mempool_stats_snapshot(mempool->stats, st);
+	st->inuse = MMEM_END(mempool) - __atomic_load_n(&mempool->free_bytes, __ATOMIC_RELAXED);
+	return mempool->stats ? 0 : -ENOENT;
+}
+
+static inline int32_t byte2kborder(uint32_t bytes)
+{
+	int32_t order;
+
+	if (bytes == 0)
+		return -1;
+	order = 31 - __builtin_clz(bytes);
+	if (bytes&((1U<<order)-1))
+		order++;
+	if (order == 0)
+		order = -1;
+	else if (order <= 10)
+		order = 0;
+	else
+		order -= 10;
+	return order;
+}
+
+/*
+ * free_area[idx]非空时, free_map第idx位置1
+ */
+static inline void __free_area_add(mmempool_t *mempool, uint32_t idx, struct list_head *node)
+{
+	struct free_area *area = &mempool->free_area[idx];
+
+	free_list_add_tail(mempool, node, &area->free_list);
+	area->nr_free++;
+	mempool->free_map |= 1U << idx;
+	__atomic_store_n(&mempool->free_bytes,
+		mempool->free_bytes + order2bytes(mempool->order_min+idx+10), __ATOMIC_RELAXED);
+}
+
+static inline void __free_area_del(mmempool_t *mempool, uint32_t idx, struct list_head *node)
+{
+	struct free_area *area = &mempool->free_area[idx];
+
+	free_list_del(mempool, node);
+	if (--area->nr_free == 0)
+		mempool->free_map &= ~(1U << idx);
+	__atomic_store_n(&mempool->free_bytes,
+		mempool->free_bytes - order2bytes(mempool->order_min+idx+10), __ATOMIC_RELAXED);
+}
+
+static inline void free_area_add(mmempool_t *mempool, uint32_t idx, struct chunk *c)
+{
+	__free_area_add(mempool, idx, &c->list);
+}
+
+static inline void free_area_del(mmempool_t *mempool, uint32_t idx, struct chunk *c)
+{
+	__free_area_del(mempool, idx, &c->list);
+}
+
+/* 空闲chunk blk挂到free_area[idx] */
+static inline void oob_add(mmempool_t *mempool, uint32_t blk, uint32_t idx)
+{
+	mempool->oob_map[blk] = idx + 1;
+	__free_area_add(mempool, idx, &mempool->oob_list[blk]);
+}
+
+static inline void oob_del(mmempool_t *mempool, uint32_t blk, uint32_t idx)
+{
+	__free_area_del(mempool, idx, &mempool->oob_list[blk]);
+	mempool->oob_map[blk] = 0;
+}
+
+static inline void *oob_blk2mem(mmempool_t *mempool, uint32_t blk)
+{
+	return (char *)mempool->mmem + ((size_t)blk << OOB_SHIFT(mempool));
+}
+
+/* 调用者需持有mempool->lock */
+static void *__oob_alloc(mmempool_t *mempool, uint32_t order)
+{
+	uint32_t want = order - mempool->order_min;
+	uint32_t idx, map, blk;
+
+	map = mempool->free_map & (~0U << want);
+	if (!map)
+		return NULL;
+	idx = __builtin_ctz(map);
+	blk = mempool->free_area[idx].free_list.next - mempool->oob_list;
+	oob_del(mempool, blk, idx);
+	/* 拆分: 高地址的一半依次挂到低一级的free_area */
+	while (idx > want) {
+		idx--;
+		oob_add(mempool, blk + (1U << idx), idx);
+	}
+	mempool->oob_map[blk] = (idx + 1) | OOB_INUSE;
+
+	return oob_blk2mem(mempool, blk);
+}
+
+/* 释放使用中的chunk blk, 与空闲伙伴逐级合并. 调用者需持有mempool->lock */
+static void __oob_free(mmempool_t *mempool, uint32_t blk)
+{
+	uint32_t idx = OOB_IDX(mempool->oob_map[blk]);
+	uint32_t top = mempool->order_max - mempool->order_min;
+	size_t nr_blk = MMEM_END(mempool) >> OOB_SHIFT(mempool);
+	uint32_t buddy;
+
+	mempool_anno_noaccess(oob_blk2mem(mempool, blk), order2bytes(idx + OOB_SHIFT(mempool)));
+	mempool->oob_map[blk] = 0;
+	while (idx < top) {
+		buddy = blk ^ (1U << idx);
+		if (buddy + (1U << idx) > nr_blk || mempool->oob_map[buddy] != idx + 1)
+			break;
+		pr_info("oob buddy combine blk=%u, buddy=%u, idx=%u\n", blk, buddy, idx);
+		oob_del(mempool, buddy, idx);
+		blk &= buddy;
+		idx++;
+	}
+	oob_add(mempool, blk, idx);
+}
+
+/*
+ * objp所在chunk(使用中或空闲)的起始块, 不在任何chunk内返回-1.
+ * 只有chunk起始块的oob_map非0, 从objp所在块开始按1,2,4...块向下对齐,
+ * 遇到的第一个非0项就是包含objp的chunk
+ */
+static int32_t oob_head(mmempool_t *mempool, void *objp)
+{
+	size_t off = (char *)objp - (char *)mempool->mmem;
+	uint32_t blk, head, k;
+	uint8_t m;
+
+	if (off >= MMEM_END(mempool))
+		return -1;
+	blk = off >> OOB_SHIFT(mempool);
+	for (k = 0; k <= mempool->order_max - mempool->order_min; k++) {
+		head = blk & ~((1U << k) - 1);
+		m = mempool->oob_map[head];
+		if (!m)
+			continue;
+		if (blk - head >= (1U << OOB_IDX(m)))
+			return -1;
+		return head;
+	}
+	return -1;
+}
+
+/* objp所在的使用中chunk的起始块, 不在使用中的chunk内返回-1 */
+static int32_t oob_lookup(mmempool_t *mempool, void *objp)
+{
+	int32_t head = oob_head(mempool, objp);
+
+	if (head < 0 || !(mempool->oob_map[head] & OOB_INUSE))
+		return -1;
+	return head;
+}
+
+/*
+ * 原地把使用中的chunk blk调整为order, 成功返回0.
+ * 增大要求blk按新大小对齐且各级伙伴空闲. 调用者需持有mempool->lock
+ */
+static int oob_resize(mmempool_t *mempool, uint32_t blk, uint32_t order)
+{
+	uint32_t idx = OOB_IDX(mempool->oob_map[blk]);
+	uint32_t nidx = order - mempool->order_min;
+	size_t nr_blk = MMEM_END(mempool) >> OOB_SHIFT(mempool);
+	uint32_t k;
+
+	if (nidx == idx)
+		return 0;
+	if (nidx > idx) {
+		if ((blk & ((1U << nidx) - 1)) || blk + (1U << nidx) > nr_blk)
+			return -1;
+		for (k = idx; k < nidx; k++) {
+			if (mempool->oob_map[blk + (1U << k)] != k + 1)
+				return -1;
+		}
+		for (k = idx; k < nidx; k++)
+			oob_del(mempool, blk + (1U << k), k);
+	} else {
+		/* 尾部依次是1,2,4...倍新大小的伙伴, 其伙伴都在使用中, 直接挂回free_area */
+		mempool_anno_noaccess(oob_blk2mem(mempool, blk + (1U << nidx)),
+			order2bytes(idx + OOB_SHIFT(mempool)) - order2bytes(nidx + OOB_SHIFT(mempool)));
+		for (k = nidx; k < idx; k++)
+			oob_add(mempool, blk + (1U << k), k);
+	}
+	mempool->oob_map[blk] = (nidx + 1) | OOB_INUSE;
+
+	return 0;
+}
+
+/* 按oob_map遍历所有chunk, 统计各order的空闲chunk数 */
+static void mmempool_dump_oob(mmempool_t *mempool, uint32_t *free_count)
+{
+	size_t nr_blk = MMEM_END(mempool) >> OOB_SHIFT(mempool);
+	size_t blk = 0;
+	uint32_t idx;
+	uint8_t m;
+
+	pr_ver("+-----------+\n");
+	while (blk < nr_blk) {
+		m = mempool->oob_map[blk];
+		if (!m || OOB_IDX(m) > mempool->order_max - mempool->order_min ||
+		    (blk & ((1U << OOB_IDX(m)) - 1))) {
+			fprintf(stderr, PRINT_COLOR_RED"blk=%zu, bad oob_map=0x%x\n"PRINT_COLOR_END, blk, m);
+			exit(-1);
+		}
+		idx = OOB_IDX(m);
+		if (m & OOB_INUSE) {
+			pr_ver("| %-4uKB-use| ----- %p\n", 1U << (idx + mempool->order_min), oob_blk2mem(mempool, blk));
+		} else {
+			pr_ver("| %-4uKB    |\n", 1U << (idx + mempool->order_min));
+			free_count[idx]++;
+		}
+		blk += 1U << idx;
+		pr_ver("+-----------+\n");
+	}
+}
+
+void mmempool_dump(mmempool_t *mempool)
 {
 	uint32_t i;
 	uint32_t free_area_num = mempool->order_max-mempool->order_min + 1;
 	uint32_t free_area_count[2][free_area_num];
 
-	sem_wait(&mempool->sem);
+	pool_lock(mempool);
 	memset(free_area_count, 0, sizeof(free_area_count));
 	pr_ver("===== mmempool dump =====\n");
 	free_area_num = mempool->order_max-mempool->order_min + 1;
@@ -376,11 +2649,19 @@ void mmempool_dump(mmempool_t *mempool)
 			mempool->order_max+1-i,
 			(1<<(mempool->order_max+1-i)),
 			mempool->free_area[free_area_num-i].nr_free);
-		list_for_each(pos, head) {
+		for (pos = head->next; pos != head; pos = free_list_next(mempool, pos)) {
+			if (mempool->oob_map) {
+				pr_ver("chunk---blk=%u\n", (uint32_t)(pos - mempool->oob_list));
+				continue;
+			}
 			tmp = list_entry(pos, struct chunk, list);
 			pr_ver("chunk---psize=%uKB,csize=%uKB\n", (uint32_t)tmp->psize>>10, (uint32_t)tmp->csize>>10);
 		}
 	}
+	if (mempool->oob_map) {
+		mmempool_dump_oob(mempool, free_area_count[1]);
+		goto check;
+	}
 	struct chunk *c = (struct chunk *)mempool->mmem;
 	pr_ver("+-----------+\n");
 	uint32_t kbsize = 0;
@@ -423,6 +2704,11 @@ void mmempool_dump(mmempool_t *mempool)
 		pr_ver("+-----------+\n");
 	}
 	pr_ver("+-----------+\n");
+	if (last_count != 1) {
+		fprintf(stderr, PRINT_COLOR_RED"ERROR! last_count = %u\n"PRINT_COLOR_END, last_count);
+		exit(-1);
+	}
+check:
 	for(i=0;i<free_area_num;i++) {
 		if (free_area_count[0][i] != free_area_count[1][i]) {
 			fprintf(stderr, PRINT_COLOR_RED"ERROR! order=%u chunk nr_free different: %u!=%u \n"PRINT_COLOR_END,
@@ -430,21 +2716,17 @@ void mmempool_dump(mmempool_t *mempool)
 			exit(-1);
 		}
 	}
-	if (last_count != 1) {
-		fprintf(stderr, PRINT_COLOR_RED"ERROR! last_count = %u\n"PRINT_COLOR_END, last_count);
-		exit(-1);
-	}
 /*
 	pr_emerg("LAST->psize=0x%x, LAST->csize=0x%x\n",
 		(uint32_t)((struct chunk *)(mempool->mmem+mempool->mem_size))->psize,
 		(uint32_t)((struct chunk *)(mempool->mmem+mempool->mem_size))->csize);
 */
 	pr_ver("=========================\n");
-	sem_post(&mempool->sem);
+	pool_unlock(mempool);
 }
 
 
-static void expand(struct chunk *c, uint32_t low, uint32_t high, struct free_area *area)
+static void expand(mmempool_t *mempool, struct chunk *c, uint32_t low, uint32_t high)
 {
 	uint32_t kbsize = 1 << high;
 	uint32_t last_chunk=0;
@@ -460,7 +2742,6 @@ static void expand(struct chunk *c, uint32_t low, uint32_t high, struct free_are
 	while (high > low) {
 		struct chunk *newc;
 		/* resize c */
-		area--;
 		high--;
 		kbsize >>= 1;
 
@@ -469,6 +2750,7 @@ static void expand(struct chunk *c, uint32_t low, uint32_t high, struct free_are
 
 		/* size newc */
 		newc = NEXT_CHUNK(c);
+		mempool_anno_defined(newc, OVERHEAD);
 		newc->psize = CHUNK_SIZE(c);
 		newc->psize |= C_INUSE;
 		newc->csize = kbsize<<10;
@@ -478,83 +2760,536 @@ static void expand(struct chunk *c, uint32_t low, uint32_t high, struct free_are
 		} else
 			NEXT_CHUNK(newc)->psize = CHUNK_SIZE(newc);
 		pr_debug("expand chunk---new chunk: psize=%uKB,csize=%uKB\n", (uint32_t)newc->psize>>10, (uint32_t)newc->csize>>10);
-		list_add_tail(&newc->list, &area->free_list);
-		area->nr_free++;
-		pr_debug("expand chunk---new area: order=%u,nr_free=%u\n", high, area->nr_free);
+		free_area_add(mempool, high - mempool->order_min, newc);
+		pr_debug("expand chunk---new area: order=%u,nr_free=%u\n", high,
+			mempool->free_area[high - mempool->order_min].nr_free);
 	}
 }
 
 static inline uint32_t kbsize2order(mmempool_t *mempool, uint32_t kbsize)
 {
-	uint32_t kborder_min,kborder_max;
 	uint32_t order;
 
-	kborder_min = mempool->order_min;
-	kborder_max = mempool->order_max;
+	pr_debug("kbsize=%uKB ---- 0x%x\n", kbsize, kbsize);
+	/* kbsize large than order_max kbsize */
+	if (kbsize >> mempool->order_max >> 1)
+		return -1;
+	/* calculate order */
+	if (kbsize <= (1U << mempool->order_min))
+		return mempool->order_min;
+	order = 31 - __builtin_clz(kbsize);
+	if (kbsize&((1U<<order)-1))
+		order++;
+	return order;
+}
+
+/* 调用者需持有mempool->lock */
+static void *__mmempool_alloc(mmempool_t *mempool, uint32_t order)
+{
+	uint32_t idx,map;
+	struct chunk *c;
+
+	pr_info("calculate order=%u\n", order);
+	if (mempool->oob_map)
+		return __oob_alloc(mempool, order);
+	/* 最小的满足order且非空的free_area */
+	map = mempool->free_map & (~0U << (order - mempool->order_min));
+	if (!map) {
+		pr_info("malloc return NULL\n");
+		return NULL;
+	}
+	idx = __builtin_ctz(map);
+	pr_debug("order=%u, idx=%u, nr_free=%u\n", order, idx, mempool->free_area[idx].nr_free);
+	c = list_first_entry(&mempool->free_area[idx].free_list, struct chunk, list);
+	free_area_del(mempool, idx, c);
+	expand(mempool, c, order, idx + mempool->order_min);
+
+	return CHUNK_TO_MEM(c);
+}
+
+static void *mmempool_alloc_with_kborder(mmempool_t *mempool, int32_t kborder)
+{
+	uint32_t order;
+	void *objp;
+
+	if (kborder < 0)
+		return NULL;
+	order = kborder;
+
+	if (order < mempool->order_min || order > mempool->order_max)
+		return NULL;
+
+	pool_lock(mempool);
+	objp = __mmempool_alloc(mempool, order);
+	pool_unlock(mempool);
+
+	return objp;
+}
+
+/*
+ * 小内存size class: 不超过MMEMPOOL_SLAB_MAX的请求按16,32...512字节分类,
+ * 从slab中分配. 每个slab是一个mmempool chunk, 按smempool方式布局:
+ *
+ *	+------------------------------------------+
+ *	|     |      |        | |    |              |
+ *	|chunk|mslab | bufctl | |obj0|......        |
+ *	|     |      |        | |    |              |
+ *	+------------------------------------------+
+ *
+ * slab_map记录每个最小order块属于哪个slab(距slab首块的块数+1, 0表示非slab),
+ * 释放时据此区分slab对象与普通chunk.
+ * 空闲对象的bufctl为下一个空闲对象的下标, 分配出去的为MSLAB_INUSE, 用于检查重复释放.
+ */
+struct mslab {
+	struct list_head list;		/* slab_partial[cls] */
+	uint16_t cls;
+	uint16_t ele_num;
+	uint16_t inuse;
+	uint16_t free;
+	char *objs;
+};
+
+#define MSLAB_MIN_SHIFT		4
+#define MSLAB_MIN_OBJS		8
+#define MSLAB_MAX_BLOCKS	128
+#define MSLAB_ORDER_NONE	0xff
+#define MSLAB_INUSE		0xffff
+#define MSLAB_SHIFT(mempool)	((mempool)->order_min+10)
+
+static inline uint16_t *mslab_bufctl(struct mslab *slab)
+{
+	return (uint16_t *)(slab+1);
+}
+
+static inline int32_t size2class(uint32_t size)
+{
+	if (size > MMEMPOOL_SLAB_MAX)
+		return -1;
+	if (size <= (1U<<MSLAB_MIN_SHIFT))
+		return 0;
+	return 32 - __builtin_clz(size - 1) - MSLAB_MIN_SHIFT;
+}
+
+/* avail为chunk中可用的字节数 */
+static uint32_t mslab_ele_num(uint32_t avail, uint32_t cls)
+{
+	uint32_t obj_size = 1U << (cls + MSLAB_MIN_SHIFT);
+	uint32_t n;
+
+	n = (avail - sizeof(struct mslab)) / (obj_size + sizeof(uint16_t));
+	while (n && ALIGN(sizeof(struct mslab) + n * sizeof(uint16_t), ALIGN_SIZE) + n * obj_size > avail)
+		n--;
+	/* 下标0xffff留给MSLAB_INUSE */
+	return min_t(uint32_t, n, MSLAB_INUSE - 1);
+}
+
+/* 每个class选择能容纳至少MSLAB_MIN_OBJS个对象的最小order */
+static int mslab_init(mmempool_t *mempool)
+{
+	uint32_t cls, order, n;
+
+	for (cls = 0; cls < MMEMPOOL_SLAB_CLASSES; cls++) {
+		INIT_LIST_HEAD(&mempool->slab_partial[cls]);
+		mempool->slab_order[cls] = MSLAB_ORDER_NONE;
+		for (order = mempool->order_min; order <= mempool->order_max; order++) {
+			if ((1U << (order - mempool->order_min)) > MSLAB_MAX_BLOCKS)
+				break;
+			n = mslab_ele_num(order2bytes(order+10) - mmem_overhead(mempool), cls);
+			if (n == 0)
+				continue;
+			mempool->slab_order[cls] = order;
+			if (n >= MSLAB_MIN_OBJS)
+				break;
+		}
+		pr_debug("class=%uB, slab order=%u\n", 1U << (cls + MSLAB_MIN_SHIFT), mempool->slab_order[cls]);
+	}
+	mempool->slab_map = (uint8_t *)calloc(((size_t)mempool->mem_size + order2bytes(MSLAB_SHIFT(mempool)) - 1) >>
+			MSLAB_SHIFT(mempool), 1);
+	return mempool->slab_map ? 0 : -ENOMEM;
+}
+
+static void __mmempool_free(mmempool_t *mempool, struct chunk *self);
+
+/* 调用者需持有mempool->lock */
+static struct mslab *mslab_new(mmempool_t *mempool, uint32_t cls)
+{
+	uint32_t order = mempool->slab_order[cls];
+	uint32_t i, blk, nr_blk;
+	struct mslab *slab;
+	uint16_t *bufctl;
+
+	slab = __mmempool_alloc(mempool, order);
+	if (!slab)
+		return NULL;
+	/* 对象在分配时才可访问 */
+	mempool_anno_defined(slab, sizeof(struct mslab));
+	slab->cls = cls;
+	slab->ele_num = mslab_ele_num(order2bytes(order+10) - mmem_overhead(mempool), cls);
+	slab->inuse = 0;
+	slab->free = 0;
+	bufctl = mslab_bufctl(slab);
+	mempool_anno_defined(bufctl, slab->ele_num * sizeof(uint16_t));
+	for (i = 0; i < slab->ele_num; i++)
+		bufctl[i] = i+1;
+	slab->objs = (char *)slab + ALIGN(sizeof(struct mslab) + slab->ele_num * sizeof(uint16_t), ALIGN_SIZE);
+
+	blk = ((char *)slab - mmem_overhead(mempool) - (char *)mempool->mmem) >> MSLAB_SHIFT(mempool);
+	nr_blk = 1U << (order - mempool->order_min);
+	for (i = 0; i < nr_blk; i++)
+		mempool->slab_map[blk+i] = i+1;
+	list_add(&slab->list, &mempool->slab_partial[cls]);
+	pr_debug("new slab=%p, class=%uB, ele_num=%u\n", slab, 1U << (cls + MSLAB_MIN_SHIFT), slab->ele_num);
+
+	return slab;
+}
+
+/* 调用者需持有mempool->lock */
+static void *mslab_alloc(mmempool_t *mempool, uint32_t cls)
+{
+	struct list_head *head = &mempool->slab_partial[cls];
+	struct mslab *slab;
+	uint16_t idx;
+
+	if (list_empty(head) && !mslab_new(mempool, cls))
+		return NULL;
+	slab = list_first_entry(head, struct mslab, list);
+	idx = slab->free;
+	slab->free = mslab_bufctl(slab)[idx];
+	mslab_bufctl(slab)[idx] = MSLAB_INUSE;
+	if (++slab->inuse == slab->ele_num)
+		list_del_init(&slab->list);
+
+	return slab->objs + ((uint32_t)idx << (cls + MSLAB_MIN_SHIFT));
+}
+
+/* objp所在slab, 非slab对象返回NULL */
+static inline struct mslab *mslab_lookup(mmempool_t *mempool, void *objp)
+{
+	size_t off = (char *)objp - (char *)mempool->mmem;
+	uint32_t blk;
+
+	if (!(mempool->flags & MEMPOOL_F_SIZE_CLASS) || off >= mempool->mem_size)
+		return NULL;
+	blk = off >> MSLAB_SHIFT(mempool);
+	if (!mempool->slab_map[blk])
+		return NULL;
+	blk -= mempool->slab_map[blk] - 1;
+
+	return (void *)((char *)mempool->mmem + ((size_t)blk << MSLAB_SHIFT(mempool)) + mmem_overhead(mempool));
+}
+
+/* objp是slab中使用中的对象时返回其下标, 否则(未对齐, 越界或已释放)返回-EINVAL. 调用者需持有mempool->lock */
+static int32_t mslab_obj_index(struct mslab *slab, void *objp)
+{
+	uint32_t shift = slab->cls + MSLAB_MIN_SHIFT;
+	size_t off = (char *)objp - slab->objs;
+	uint32_t idx;
+
+	if ((char *)objp < slab->objs || (off & ((1U << shift) - 1)))
+		return -EINVAL;
+	idx = off >> shift;
+	if (idx >= slab->ele_num || mslab_bufctl(slab)[idx] != MSLAB_INUSE)
+		return -EINVAL;
+	return idx;
+}
+
+/* objp不是slab中使用中的对象时返回-EINVAL. 调用者需持有mempool->lock */
+static int mslab_free(mmempool_t *mempool, struct mslab *slab, void *objp)
+{
+	struct list_head *head = &mempool->slab_partial[slab->cls];
+	uint32_t blk, nr_blk;
+	int32_t idx;
+
+	idx = mslab_obj_index(slab, objp);
+	if (idx < 0)
+		return idx;
+	mmem_anno_free(mempool, objp);
+	mslab_bufctl(slab)[idx] = slab->free;
+	slab->free = idx;
+	if (slab->inuse-- == slab->ele_num)
+		list_add(&slab->list, head);
+	/* 空slab归还给mmempool, 但保留最后一个避免反复创建 */
+	if (slab->inuse || list_is_singular(head))
+		return 0;
+	list_del(&slab->list);
+	blk = ((char *)slab - mmem_overhead(mempool) - (char *)mempool->mmem) >> MSLAB_SHIFT(mempool);
+	nr_blk = 1U << (mempool->slab_order[slab->cls] - mempool->order_min);
+	memset(&mempool->slab_map[blk], 0, nr_blk);
+	if (mempool->oob_map)
+		__oob_free(mempool, blk);
+	else
+		__mmempool_free(mempool, MEM_TO_CHUNK(slab));
+	return 0;
+}
+
+static inline int32_t mmempool_size_class(mmempool_t *mempool, uint32_t size)
+{
+	int32_t cls;
+
+	if (!(mempool->flags & MEMPOOL_F_SIZE_CLASS))
+		return -1;
+	cls = size2class(size);
+	if (cls < 0 || mempool->slab_order[cls] == MSLAB_ORDER_NONE)
+		return -1;
+	return cls;
+}
+
+static inline void mmem_stat_alloc(mmempool_t *mempool, int32_t cls, int32_t kborder, uint32_t got, uint32_t want)
+{
+	struct mempool_counters *stats = mempool->stats;
+
+	if (!stats)
+		return;
+	mempool_stat_add(stats, allocs, got);
+	if (got < want)
+		mempool_stat_add(stats, failures, want - got);
+	if (cls >= 0)
+		mempool_stat_add(stats, class_allocs[cls], got);
+	else if (kborder >= 0 && kborder < MEMPOOL_STAT_ORDERS)
+		mempool_stat_add(stats, order_allocs[kborder], got);
+	mempool_stat_high_water(stats, MMEM_END(mempool) - __atomic_load_n(&mempool->free_bytes, __ATOMIC_RELAXED));
+}
+
+static void *mmem_alloc(mmempool_t *mempool, uint32_t size)
+{
+	int32_t kborder, cls;
+	void *objp;
+
+	cls = mmempool_size_class(mempool, size);
+	if (cls >= 0) {
+		pool_lock(mempool);
+		objp = mslab_alloc(mempool, cls);
+		pool_unlock(mempool);
+		mmem_stat_alloc(mempool, cls, -1, objp != NULL, 1);
+		return objp;
+	}
+	size += mmem_overhead(mempool);
+	kborder = byte2kborder(size);
+	pr_info("size=%u, kborder=%d\n", size, kborder);
+	objp = mmempool_alloc_with_kborder(mempool, kborder);
+	mmem_stat_alloc(mempool, -1, kborder, objp != NULL, 1);
+	return objp;
+}
+
+static void *mmem_alloc_aligned(mmempool_t *mempool, uint32_t size, uint32_t align)
+{
+	struct chunk *c, *fake;
+	int32_t kborder;
+	uintptr_t mem;
+	size_t need;
+
+	if (align <= MMEMPOOL_ALIGN && !((uintptr_t)mempool->mmem & (align - 1)))
+		return mmem_alloc(mempool, size);
+	if (mempool->oob_map) {
+		/* chunk按自身大小对齐, mmem也按align对齐时chunk起始就满足对齐 */
+		if ((uintptr_t)mempool->mmem & (align - 1))
+			need = (size_t)size + align;
+		else
+			need = size > align ? size : align;
+	} else {
+		/*
+		 * chunk起始ALIGN_SIZE对齐时对齐地址不超过chunk+align;
+		 * 否则(外部传入的内存)假头部可能要多跳过一个align, 但不超过chunk+align+2*OVERHEAD
+		 */
+		need = (size_t)size + align;
+		if ((uintptr_t)mempool->mmem & (ALIGN_SIZE-1))
+			need += 2 * OVERHEAD;
+	}
+	if (need > order2bytes(mempool->order_max+10)) {
+		mmem_stat_alloc(mempool, -1, -1, 0, 1);
+		return NULL;
+	}
+	kborder = byte2kborder(need);
+	if (kborder < (int32_t)mempool->order_min)
+		kborder = mempool->order_min;
+	pool_lock(mempool);
+	mem = (uintptr_t)__mmempool_alloc(mempool, kborder);
+	pool_unlock(mempool);
+	mmem_stat_alloc(mempool, -1, kborder, mem != 0, 1);
+	if (!mem || !(mem & (align - 1)))
+		return (void *)mem;
+	/* oob模式由oob_lookup找到chunk起始, 不需要假头部 */
+	if (mempool->oob_map)
+		return (void *)ALIGN(mem, (uintptr_t)align);
+
+	c = MEM_TO_CHUNK(mem);
+	mem = ALIGN(mem, (uintptr_t)align);
+	if (mem - OVERHEAD < (uintptr_t)c + OVERHEAD)
+		mem += align;
+	fake = MEM_TO_CHUNK(mem);
+	mempool_anno_noaccess(CHUNK_TO_MEM(c), (char *)fake - (char *)CHUNK_TO_MEM(c));
+	mempool_anno_defined(fake, OVERHEAD);
+	fake->psize = mem - (uintptr_t)c;
+	fake->csize = C_ALIGNED | C_INUSE;
+	pr_info("aligned chunk=%p, objp=%p, align=%u\n", c, (void *)mem, align);
+
+	return (void *)mem;
+}
+
+/* MEMPOOL_F_DEBUG: red zone在可用空间末尾 */
+static void *mmem_debug_alloc(mmempool_t *mempool, void *objp)
+{
+	if (objp)
+		mempool_redzone_set((char *)objp + mmem_usable_size(mempool, objp) - MEMPOOL_REDZONE, RED_ACTIVE);
+	return objp;
+}
+
+/*
+ * MEMPOOL_F_DEBUG: 检查objp是否为使用中的对象, 返回可用字节数(含red zone),
+ * 有问题时报告并返回0
+ */
+static uint32_t mmem_debug_check(mmempool_t *mempool, void *objp, const char *op)
+{
+	size_t off = (char *)objp - (char *)mempool->mmem;
+	char what[64];
+	uint32_t usable;
+	int32_t head;
+	uint64_t red;
+	int freed;
+
+	if (off >= MMEM_END(mempool)) {
+		snprintf(what, sizeof(what), "invalid %s", op);
+		goto bad;
+	}
+	if (!mslab_lookup(mempool, objp)) {
+		if (mempool->oob_map) {
+			/* 所在chunk在oob_map中已经空闲 */
+			pool_lock(mempool);
+			head = oob_head(mempool, objp);
+			freed = head >= 0 && !(mempool->oob_map[head] & OOB_INUSE);
+			pool_unlock(mempool);
+		} else {
+			freed = !(mem2chunk(objp)->csize & C_INUSE);
+		}
+		if (freed) {
+			snprintf(what, sizeof(what), "%s of freed object", op);
+			goto bad;
+		}
+	}
+	usable = mmem_usable_size(mempool, objp);
+	if (usable < MEMPOOL_REDZONE || usable > MMEM_END(mempool) - off) {
+		snprintf(what, sizeof(what), "invalid %s", op);
+		goto bad;
+	}
+	red = mempool_redzone_get((char *)objp + usable - MEMPOOL_REDZONE);
+	if (red == RED_ACTIVE)
+		return usable;
+	if (red == RED_INACTIVE)
+		snprintf(what, sizeof(what), "%s of freed object", op);
+	else
+		snprintf(what, sizeof(what), "red zone overwritten (buffer overflow) on %s", op);
+bad:
+	mempool_report(mempool->stats, "mmempool", mempool, objp, what);
+	return 0;
+}
+
+static void mmem_free(mmempool_t *mempool, void *objp);
+
+/* MEMPOOL_F_DEBUG: 检查并隔离objp, 释放没有抽中的objp和被挤出隔离区的对象 */
+static void mmem_debug_free(mmempool_t *mempool, void *objp)
+{
+	uint32_t usable;
 
-	pr_debug("kbsize=%uKB ---- 0x%x\n", kbsize, kbsize);
-	/* kbsize large than order_max kbsize */
-	pr_debug("(1U<<(kborder_max+1)) = 0x%x\n", (1U<<(kborder_max+1)));
-	if ((kbsize&(~((1U<<(kborder_max+1))-1))) != 0)
-		return -1;
-	/* calculate order */
-	pr_info("order min=%u - 0x%x, max=%u - 0x%x\n", kborder_min, 1<<kborder_min, kborder_max, 1<<kborder_max);
-	for (order = kborder_max; order > kborder_min-1; order--){
-			pr_debug("kbsize=0x%x, order=%u\n", kbsize, order);
-			if ((kbsize&(1<<order)) != 0) {
-				if (kbsize&((1U<<order)-1))
-					order++;
-				break;
-			}
+	usable = mmem_debug_check(mempool, objp, "free");
+	if (!usable)
+		return;
+	mempool_redzone_set((char *)objp + usable - MEMPOOL_REDZONE, RED_INACTIVE);
+	if (!mempool_debug_sampled(mempool->flags) || !mempool->quarantine) {
+		mmem_free(mempool, objp);
+		return;
 	}
-	return order;
+	mempool_poison(objp, usable - MEMPOOL_REDZONE);
+	mempool_anno_noaccess(objp, usable - MEMPOOL_REDZONE);
+	pool_lock(mempool);
+	mempool_quarantine_push(mempool->quarantine, objp, usable);
+	/* 大对象可能一次挤出多个 */
+	while ((objp = mempool_quarantine_pop(mempool->quarantine))) {
+		pool_unlock(mempool);
+		if (mempool_poison_check(objp, mmem_usable_size(mempool, objp) - MEMPOOL_REDZONE))
+			mempool_report(mempool->stats, "mmempool", mempool, objp, "use after free (poison overwritten)");
+		mmem_free(mempool, objp);
+		pool_lock(mempool);
+	}
+	pool_unlock(mempool);
 }
 
-static void *mmempool_alloc_with_kborder(mmempool_t *mempool, int32_t kborder)
+void *mmempool_alloc(mmempool_t *mempool, uint32_t size)
 {
-	uint32_t order,cur_order,idx;
-	struct free_area *area;
-	struct chunk *c;
-
-	if (kborder < 0)
+	if (!mempool)
 		return NULL;
-	order = kborder;
+	if (mempool->flags & MEMPOOL_F_DEBUG) {
+		if (size > UINT32_MAX - MEMPOOL_REDZONE)
+			return NULL;
+		return mmem_anno_alloc(mempool, mmem_debug_alloc(mempool, mmem_alloc(mempool, size + MEMPOOL_REDZONE)), size);
+	}
+	return mmem_anno_alloc(mempool, mmem_alloc(mempool, size), size);
+}
 
-	if (order < mempool->order_min || order > mempool->order_max)
+/*
+ * 分配size字节, 返回的指针按align(2的n次方, 不超过最大chunk)对齐.
+ * 若chunk头部之后恰好对齐则直接返回, 否则在chunk内取第一个对齐地址,
+ * 前面写一个假头部指回真正的chunk, 因此chunk至少为size+align字节.
+ * 返回的指针可以直接mmempool_free/mmempool_realloc.
+ */
+void *mmempool_alloc_aligned(mmempool_t *mempool, uint32_t size, uint32_t align)
+{
+	if (!mempool || !align || (align & (align - 1)))
 		return NULL;
-
-	sem_wait(&mempool->sem);
-	pr_info("calculate order=%u\n", order);
-	pr_debug("find order:\n");
-	for (cur_order = order; cur_order <= mempool->order_max; cur_order++) {
-		idx = cur_order - mempool->order_min;
-		area = &mempool->free_area[idx];
-		pr_debug("prepare area=%p, list=%p, nr_free=%u\n", area, &area->free_list, area->nr_free);
-		pr_debug("cur_order=%u, idx=%u,area->nr_free=%u\n", cur_order, idx, area->nr_free);
-		if (list_empty(&area->free_list))
-			continue;
-		c = list_first_entry(&area->free_list, struct chunk, list);
-		list_del(&c->list);
-		area->nr_free--;
-		expand(c, order, cur_order, area);
-
-		sem_post(&mempool->sem);
-		return CHUNK_TO_MEM(c);
+	if (mempool->flags & MEMPOOL_F_DEBUG) {
+		if (size > UINT32_MAX - MEMPOOL_REDZONE)
+			return NULL;
+		return mmem_anno_alloc(mempool, mmem_debug_alloc(mempool,
+				mmem_alloc_aligned(mempool, size + MEMPOOL_REDZONE, align)), size);
 	}
-
-	sem_post(&mempool->sem);
-	pr_info("malloc return NULL\n");
-	return NULL;
+	return mmem_anno_alloc(mempool, mmem_alloc_aligned(mempool, size, align), size);
 }
 
-void *mmempool_alloc(mmempool_t *mempool, uint32_t size)
+/*
+ * 一次加锁分配n个大小为size的内存块, 返回实际分配的个数
+ */
+uint32_t mmempool_alloc_bulk(mmempool_t *mempool, uint32_t size, void **objs, uint32_t n)
 {
-	int32_t kborder;
+	int32_t kborder, cls;
+	uint32_t i;
 
-	size += 16;
-	kborder = byte2kborder(size);
-	pr_info("size=%u, kborder=%d\n", size, kborder);
-	return mmempool_alloc_with_kborder(mempool, kborder);
+	if (!mempool || !objs)
+		return 0;
+	if (mempool->flags & MEMPOOL_F_DEBUG) {
+		for (i = 0; i < n; i++) {
+			objs[i] = mmempool_alloc(mempool, size);
+			if (!objs[i])
+				break;
+		}
+		return i;
+	}
+	cls = mmempool_size_class(mempool, size);
+	if (cls >= 0) {
+		pool_lock(mempool);
+		for (i = 0; i < n; i++) {
+			objs[i] = mmem_anno_alloc(mempool, mslab_alloc(mempool, cls), size);
+			if (!objs[i])
+				break;
+		}
+		pool_unlock(mempool);
+		mmem_stat_alloc(mempool, cls, -1, i, n);
+		return i;
+	}
+	kborder = byte2kborder(size + mmem_overhead(mempool));
+	if (kborder < 0 || kborder < mempool->order_min || kborder > mempool->order_max) {
+		mmem_stat_alloc(mempool, -1, -1, 0, n);
+		return 0;
+	}
+
+	pool_lock(mempool);
+	for (i = 0; i < n; i++) {
+		objs[i] = mmem_anno_alloc(mempool, __mmempool_alloc(mempool, kborder), size);
+		if (!objs[i])
+			break;
+	}
+	pool_unlock(mempool);
+	mmem_stat_alloc(mempool, -1, kborder, i, n);
+
+	return i;
 }
 
 
@@ -579,18 +3314,17 @@ static struct chunk *split(mmempool_t *mempool, struct chunk *c)
 				if (CHUNK_SIZE(c) == size) {
 					pr_debug("split last chunk, c=%p, size=%uKB\n", c, (uint32_t)CHUNK_SIZE(c)>>10);
 					idx = i-mempool->order_min;
-					list_add_tail(&c->list, &mempool->free_area[idx].free_list);
-					mempool->free_area[idx].nr_free++;
+					free_area_add(mempool, idx, c);
 					return c;
 				}
 				new = c;
 				c = ((struct chunk *)((char *)(c) + size));
+				mempool_anno_defined(c, OVERHEAD);
 				c->csize = (CHUNK_SIZE(new)-size) | C_INUSE | (new->csize&C_LAST);
 				/* init new (free) chunk */
 				idx = i-mempool->order_min;
 				new->csize = size;
-				list_add_tail(&new->list, &mempool->free_area[idx].free_list);
-				mempool->free_area[idx].nr_free++;
+				free_area_add(mempool, idx, new);
 				/* init remain chunk */
 				c->psize = CHUNK_SIZE(new);
 			}
@@ -619,11 +3353,11 @@ static struct chunk *combine_chunk(mmempool_t *mempool, struct chunk *cur, uint3
 			order = byte2kborder(CHUNK_SIZE(prev));
 			if (order == mempool->order_max)
 				break;
-			list_del(&prev->list);
 			idx = order-mempool->order_min;
 			pr_info("prev size=%uKB, order=%u\n", (uint32_t)CHUNK_SIZE(prev)>>10, order);
-			mempool->free_area[idx].nr_free--;
+			free_area_del(mempool, idx, prev);
 			prev->csize = (cur->csize + CHUNK_SIZE(prev)) | C_INUSE;
+			mempool_anno_noaccess(cur, sizeof(struct chunk));
 			cur = prev;
 			pr_info("++++++add back size:%uKB\n", (uint32_t)(CHUNK_SIZE(cur)>>10));
 		} else
@@ -642,9 +3376,9 @@ static struct chunk *combine_chunk(mmempool_t *mempool, struct chunk *cur, uint3
 			if (order == mempool->order_max)
 				break;
 			idx = order-mempool->order_min;
-			list_del(&next->list);
-			mempool->free_area[idx].nr_free--;
+			free_area_del(mempool, idx, next);
 			cur->csize = (cur->csize + CHUNK_SIZE(next)) |C_INUSE;
+			mempool_anno_noaccess(next, sizeof(struct chunk));
 			pr_info("++++++add forward size:%uKB\n", (uint32_t)(CHUNK_SIZE(cur)>>10));
 			if (k&C_LAST) {
 				cur->csize |= C_LAST;
@@ -668,23 +3402,628 @@ split_chunk:
 	return cur;
 }
 
-void mmempool_free(mmempool_t *mempool, void *objp)
+/*
+ * 伙伴模式: 所有chunk按自身大小对齐(相对mmem), 伙伴地址为 offset ^ size,
+ * 逐级合并, 无需再split
+ */
+static struct chunk *buddy_combine(mmempool_t *mempool, struct chunk *c)
+{
+	char *base = mempool->mmem;
+	size_t size = CHUNK_SIZE(c);
+	size_t last = c->csize & C_LAST;
+	size_t end = MMEM_END(mempool);
+	uint32_t order = byte2kborder(size);
+	size_t off, boff;
+	struct chunk *buddy;
+
+	while (order < mempool->order_max) {
+		off = (char *)c - base;
+		boff = off ^ size;
+		if (boff + size > end)
+			break;
+		buddy = (struct chunk *)(base + boff);
+		if ((buddy->csize&C_INUSE) || CHUNK_SIZE(buddy) != size)
+			break;
+		pr_info("buddy combine chunk=%p, buddy=%p, size=%uKB\n", c, buddy, (uint32_t)size>>10);
+		free_area_del(mempool, order-mempool->order_min, buddy);
+		/* 被合并的头部成为chunk内部 */
+		if (boff < off) {
+			mempool_anno_noaccess(c, sizeof(struct chunk));
+			c = buddy;
+		} else {
+			last = buddy->csize & C_LAST;
+			mempool_anno_noaccess(buddy, sizeof(struct chunk));
+		}
+		size <<= 1;
+		order++;
+	}
+	c->csize = size | last;
+	if (!last)
+		NEXT_CHUNK(c)->psize = size;
+	free_area_add(mempool, order-mempool->order_min, c);
+
+	return c;
+}
+
+/* 调用者需持有mempool->lock */
+static void __mmempool_free(mmempool_t *mempool, struct chunk *self)
 {
-	struct chunk *self;
 	uint32_t order;
 
+	order = byte2kborder(CHUNK_SIZE(self));
+	mempool_anno_noaccess(CHUNK_TO_MEM(self), CHUNK_SIZE(self) - OVERHEAD);
+	pr_info("self=%p, csize=%uKB, psize=%uKB\n", self, (uint32_t)CHUNK_SIZE(self)>>10, (uint32_t)CHUNK_PSIZE(self)>>10);
+
+	/* combine chunk */
+	if (mempool->flags & MEMPOOL_F_BUDDY)
+		self = buddy_combine(mempool, self);
+	else
+		self = combine_chunk(mempool, self, order);
+}
+
+static void mmem_free(mmempool_t *mempool, void *objp)
+{
+	struct chunk *self;
+	struct mslab *slab;
+	int32_t blk;
+
+	slab = mslab_lookup(mempool, objp);
+	if (slab) {
+		pool_lock(mempool);
+		blk = mslab_free(mempool, slab, objp);
+		pool_unlock(mempool);
+		if (!blk)
+			mempool_stat_add(mempool->stats, frees, 1);
+		return;
+	}
+	if (mempool->oob_map) {
+		pool_lock(mempool);
+		blk = oob_lookup(mempool, objp);
+		if (blk >= 0) {
+			mmem_anno_free(mempool, objp);
+			__oob_free(mempool, blk);
+		}
+		pool_unlock(mempool);
+		if (blk >= 0)
+			mempool_stat_add(mempool->stats, frees, 1);
+		return;
+	}
+	self = mem2chunk(objp);
+	if (!(self->csize&C_INUSE))
+		return;
+	mmem_anno_free(mempool, objp);
+	mempool_stat_add(mempool->stats, frees, 1);
+	pool_lock(mempool);
+	__mmempool_free(mempool, self);
+	pool_unlock(mempool);
+}
+
+void mmempool_free(mmempool_t *mempool, void *objp)
+{
 	pr_info("mempool=%p, objp=%p\n", mempool, objp);
 	if (objp == NULL)
 		return;
-	self = MEM_TO_CHUNK(objp);
-	if (!(self->csize&C_INUSE))
+	if (mempool->flags & MEMPOOL_F_DEBUG)
+		mmem_debug_free(mempool, objp);
+	else
+		mmem_free(mempool, objp);
+}
+
+/*
+ * 一次加锁释放n个内存块
+ */
+void mmempool_free_bulk(mmempool_t *mempool, void **objs, uint32_t n)
+{
+	struct chunk *self;
+	struct mslab *slab;
+	uint32_t i, freed = 0;
+	int32_t blk;
+
+	if (!mempool || !objs)
+		return;
+	if (mempool->flags & MEMPOOL_F_DEBUG) {
+		for (i = 0; i < n; i++)
+			mmempool_free(mempool, objs[i]);
+		return;
+	}
+	pool_lock(mempool);
+	for (i = 0; i < n; i++) {
+		if (objs[i] == NULL)
+			continue;
+		slab = mslab_lookup(mempool, objs[i]);
+		if (slab) {
+			if (!mslab_free(mempool, slab, objs[i]))
+				freed++;
+			continue;
+		}
+		if (mempool->oob_map) {
+			blk = oob_lookup(mempool, objs[i]);
+			if (blk < 0)
+				continue;
+			mmem_anno_free(mempool, objs[i]);
+			__oob_free(mempool, blk);
+			freed++;
+			continue;
+		}
+		self = mem2chunk(objs[i]);
+		if (!(self->csize&C_INUSE))
+			continue;
+		mmem_anno_free(mempool, objs[i]);
+		__mmempool_free(mempool, self);
+		freed++;
+	}
+	pool_unlock(mempool);
+	mempool_stat_add(mempool->stats, frees, freed);
+}
+
+/*
+ * 把使用中的chunk c截短为size字节, 尾部归还free_area. 调用者需持有mempool->lock
+ */
+static void chunk_trim(mmempool_t *mempool, struct chunk *c, size_t size)
+{
+	size_t last = c->csize & C_LAST;
+	size_t end = CHUNK_SIZE(c);
+	struct chunk *tail;
+	size_t s;
+
+	c->csize = size | C_INUSE;
+	mempool_anno_noaccess((char *)c + size, end - size);
+	if (!(mempool->flags & MEMPOOL_F_BUDDY)) {
+		/* 尾部作为一个使用中的chunk释放, 由combine_chunk向后合并并拆分 */
+		tail = (struct chunk *)((char *)c + size);
+		mempool_anno_defined(tail, OVERHEAD);
+		tail->psize = c->csize;
+		tail->csize = (end - size) | C_INUSE | last;
+		if (!last)
+			NEXT_CHUNK(tail)->psize = tail->csize;
+		combine_chunk(mempool, tail, 0);
 		return;
-	sem_wait(&mempool->sem);
+	}
+	/* 伙伴模式: 尾部依次是大小为size, 2*size...的伙伴, 逐个释放 */
+	mempool_anno_defined((char *)c + size, OVERHEAD);
+	for (s = size; s < end; s <<= 1) {
+		tail = (struct chunk *)((char *)c + s);
+		if (s == size)
+			tail->psize = c->csize;
+		tail->csize = s | C_INUSE | ((s << 1) == end ? last : 0);
+		/* buddy_combine会写下一个尾部的psize */
+		if ((s << 1) < end)
+			mempool_anno_defined((char *)tail + s, OVERHEAD);
+		buddy_combine(mempool, tail);
+	}
+}
 
-	order = byte2kborder(CHUNK_SIZE(self));
-	pr_info("self=%p, csize=%uKB, psize=%uKB\n", self, (uint32_t)CHUNK_SIZE(self)>>10, (uint32_t)CHUNK_PSIZE(self)>>10);
+/*
+ * 原地把使用中的chunk c调整为size(2的n次方)字节, 成功返回0.
+ * 增大时吞并后面空闲的chunk, 伙伴模式下要求c按size对齐且各级伙伴空闲.
+ * 调用者需持有mempool->lock
+ */
+static int chunk_resize(mmempool_t *mempool, struct chunk *c, size_t size)
+{
+	char *base = mempool->mmem;
+	size_t cur = CHUNK_SIZE(c);
+	size_t off = (char *)c - base;
+	size_t last = c->csize & C_LAST;
+	size_t total, s;
+	struct chunk *n;
+
+	if (size == cur)
+		return 0;
+	if (size < cur) {
+		chunk_trim(mempool, c, size);
+		return 0;
+	}
+	if (mempool->flags & MEMPOOL_F_BUDDY) {
+		if ((off & (size - 1)) || off + size > MMEM_END(mempool))
+			return -1;
+		for (s = cur; s < size; s <<= 1) {
+			n = (struct chunk *)(base + off + s);
+			if ((n->csize & C_INUSE) || CHUNK_SIZE(n) != s)
+				return -1;
+		}
+		for (s = cur; s < size; s <<= 1) {
+			n = (struct chunk *)(base + off + s);
+			last = n->csize & C_LAST;
+			free_area_del(mempool, byte2kborder(s) - mempool->order_min, n);
+		}
+		total = size;
+	} else {
+		for (total = cur; total < size && !last; total += CHUNK_SIZE(n)) {
+			n = (struct chunk *)((char *)c + total);
+			if (n->csize & C_INUSE)
+				return -1;
+			last = n->csize & C_LAST;
+		}
+		if (total < size)
+			return -1;
+		for (s = cur; s < total; s += CHUNK_SIZE(n)) {
+			n = (struct chunk *)((char *)c + s);
+			free_area_del(mempool, byte2kborder(CHUNK_SIZE(n)) - mempool->order_min, n);
+		}
+	}
+	c->csize = total | C_INUSE | last;
+	if (!last)
+		NEXT_CHUNK(c)->psize = c->csize;
+	if (total > size)
+		chunk_trim(mempool, c, size);
+	pr_info("chunk=%p resize %uKB -> %uKB\n", c, (uint32_t)cur>>10, (uint32_t)size>>10);
+
+	return 0;
+}
 
-	/* combine chunk */
-	self = combine_chunk(mempool, self, order);
-	sem_post(&mempool->sem);
+/*
+ * 调整objp的大小为size字节: chunk原地缩小/增大, 不行时分配新内存并拷贝.
+ * size class对象在新大小仍属于同一class时原地返回, 否则拷贝.
+ * 失败返回NULL, objp保持不变, err为-EINVAL(objp不是使用中的对象)
+ * 或-ENOMEM(原地调整和重新分配都不行).
+ */
+static void *mmem_realloc(mmempool_t *mempool, void *objp, uint32_t size, int *err)
+{
+	struct mslab *slab;
+	struct chunk *c;
+	int32_t kborder, blk = 0;
+	uint32_t old, need;
+	size_t off, cur;
+	void *newp;
+	int ret;
+
+	*err = -ENOMEM;
+	if (!objp)
+		return mmempool_alloc(mempool, size);
+	if (!size) {
+		*err = 0;
+		mmempool_free(mempool, objp);
+		return NULL;
+	}
+	/* MEMPOOL_F_DEBUG: 原地调整时red zone移到新的末尾 */
+	if ((mempool->flags & MEMPOOL_F_DEBUG) && !mmem_debug_check(mempool, objp, "realloc"))
+		goto inval;
+	if (size > UINT32_MAX - mmem_redzone(mempool))
+		return NULL;
+	need = size + mmem_redzone(mempool);
+	slab = mslab_lookup(mempool, objp);
+	if (slab) {
+		pool_lock(mempool);
+		ret = mslab_obj_index(slab, objp);
+		pool_unlock(mempool);
+		if (ret < 0)
+			goto inval;
+		old = 1U << (slab->cls + MSLAB_MIN_SHIFT);
+		if (mmempool_size_class(mempool, need) == slab->cls) {
+			mempool_anno_resize(mempool, objp, size, old - mmem_redzone(mempool), old - mmem_redzone(mempool));
+			return objp;
+		}
+		goto copy;
+	}
+	if (mempool->oob_map) {
+		blk = oob_lookup(mempool, objp);
+		if (blk < 0)
+			goto inval;
+		c = oob_blk2mem(mempool, blk);
+		cur = order2bytes(OOB_IDX(mempool->oob_map[blk]) + OOB_SHIFT(mempool));
+	} else {
+		c = mem2chunk(objp);
+		if (!(c->csize&C_INUSE))
+			goto inval;
+		cur = CHUNK_SIZE(c);
+	}
+	/* 对齐分配的objp不在chunk头部之后, 原地调整时保持原来的偏移和对齐 */
+	off = (char *)objp - (char *)c;
+	old = cur - off;
+	/* 缩小到size class范围时换到slab中, 节省内存 */
+	if (mmempool_size_class(mempool, need) >= 0)
+		goto copy;
+	if (need > UINT32_MAX - off)
+		return NULL;
+	kborder = byte2kborder(need + off);
+	if (kborder < (int32_t)mempool->order_min)
+		kborder = mempool->order_min;
+	if (kborder > (int32_t)mempool->order_max)
+		return NULL;
+	pool_lock(mempool);
+	if (mempool->oob_map)
+		ret = oob_resize(mempool, blk, kborder);
+	else
+		ret = chunk_resize(mempool, c, order2bytes(kborder+10));
+	pool_unlock(mempool);
+	if (!ret) {
+		if (mempool->flags & MEMPOOL_F_DEBUG)
+			mmem_debug_alloc(mempool, objp);
+		mempool_anno_resize(mempool, objp, size, old - mmem_redzone(mempool),
+			mmem_usable_size(mempool, objp) - mmem_redzone(mempool));
+		return objp;
+	}
+copy:
+	newp = mmempool_alloc(mempool, size);
+	if (!newp)
+		return NULL;
+	mempool_anno_usable(objp, old - mmem_redzone(mempool));
+	memcpy(newp, objp, min_t(uint32_t, old - mmem_redzone(mempool), size));
+	mmempool_free(mempool, objp);
+
+	return newp;
+inval:
+	*err = -EINVAL;
+	return NULL;
+}
+
+void *mmempool_realloc(mmempool_t *mempool, void *objp, uint32_t size)
+{
+	int err;
+
+	if (!mempool)
+		return NULL;
+	return mmem_realloc(mempool, objp, size, &err);
+}
+
+static uint32_t mmem_usable_size(mmempool_t *mempool, void *objp)
+{
+	struct mslab *slab;
+	struct chunk *c;
+	int32_t blk;
+
+	slab = mslab_lookup(mempool, objp);
+	if (slab)
+		return 1U << (slab->cls + MSLAB_MIN_SHIFT);
+	if (mempool->oob_map) {
+		blk = oob_lookup(mempool, objp);
+		if (blk < 0)
+			return 0;
+		return (char *)oob_blk2mem(mempool, blk) +
+			order2bytes(OOB_IDX(mempool->oob_map[blk]) + OOB_SHIFT(mempool)) - (char *)objp;
+	}
+	c = mem2chunk(objp);
+	return (char *)c + CHUNK_SIZE(c) - (char *)objp;
+}
+
+/*
+ * objp实际可用的字节数(chunk或size class大小, 不含red zone), 不小于申请时的大小
+ */
+uint32_t mmempool_usable_size(mmempool_t *mempool, void *objp)
+{
+	uint32_t usable;
+
+	if (!mempool || !objp)
+		return 0;
+	usable = mmem_usable_size(mempool, objp);
+	usable = usable > mmem_redzone(mempool) ? usable - mmem_redzone(mempool) : 0;
+	/* 同malloc_usable_size, 调用者可以使用全部可用空间 */
+	mempool_anno_usable(objp, usable);
+	return usable;
+}
+
+
+/*
+ * mmempool arena: 将一块内存等分为nr_shards个mmempool(默认每CPU一个),
+ * 分配走当前CPU所在分片, 本分片不足时依次从相邻分片窃取,
+ * 释放按地址范围归还到所属分片.
+ */
+mmempool_arena_t *mmempool_arena_create(void *mem_ptr, uint32_t mem_size, uint32_t order_min, uint32_t order_max,
+		uint32_t nr_shards, uint32_t flags)
+{
+	mmempool_arena_t *arena;
+	uint32_t i, granule;
+	long cpus;
+
+	if (mem_size == 0 || order_min > order_max || order_max + 10 >= 32)
+		return NULL;
+	if (!nr_shards) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_shards = cpus > 0 ? cpus : 1;
+	}
+	granule = order2bytes(order_min+10);
+	if (mem_size / nr_shards < granule)
+		return NULL;
+
+	arena = (mmempool_arena_t *)calloc(1, sizeof(mmempool_arena_t));
+	if (!arena)
+		return NULL;
+	arena->shard = (mmempool_t **)calloc(nr_shards, sizeof(mmempool_t *));
+	if (!arena->shard)
+		goto err;
+	if (!mem_ptr) {
+		arena->mem = mempool_region_alloc(mem_size, flags, &arena->backing);
+		if (!arena->mem)
+			goto err;
+	} else {
+		arena->mem = mem_ptr;
+		arena->backing = MEMPOOL_MEM_EXTERNAL;
+	}
+	arena->mem_size = mem_size;
+	arena->nr_shards = nr_shards;
+	arena->shard_size = (mem_size / nr_shards) & ~(granule-1);
+	for (i = 0; i < nr_shards; i++) {
+		arena->shard[i] = mmempool_create_ex((char *)arena->mem + (size_t)i * arena->shard_size,
+				arena->shard_size, order_min, order_max, flags);
+		if (!arena->shard[i])
+			goto err;
+	}
+	pr_debug("arena mem=%p, nr_shards=%u, shard_size=%u\n", arena->mem, nr_shards, arena->shard_size);
+
+	return arena;
+err:
+	mmempool_arena_destroy(arena);
+	return NULL;
+}
+
+void mmempool_arena_destroy(mmempool_arena_t *arena)
+{
+	uint32_t i;
+
+	if (!arena)
+		return;
+	if (arena->shard) {
+		for (i = 0; i < arena->nr_shards; i++)
+			mmempool_destroy(arena->shard[i]);
+		free(arena->shard);
+	}
+	if (arena->mem)
+		mempool_region_free(arena->mem, arena->mem_size, arena->backing);
+	free(arena);
+}
+
+static __thread int arena_thread_shard = -1;
+static uint32_t arena_shard_next;
+
+static inline uint32_t mmempool_arena_shard(mmempool_arena_t *arena)
+{
+	int cpu = sched_getcpu();
+
+	if (cpu < 0) {
+		if (arena_thread_shard < 0)
+			arena_thread_shard = __atomic_fetch_add(&arena_shard_next, 1, __ATOMIC_RELAXED);
+		cpu = arena_thread_shard;
+	}
+	return (uint32_t)cpu % arena->nr_shards;
+}
+
+void *mmempool_arena_alloc(mmempool_arena_t *arena, uint32_t size)
+{
+	uint32_t i, idx;
+	void *objp;
+
+	if (!arena)
+		return NULL;
+	idx = mmempool_arena_shard(arena);
+	for (i = 0; i < arena->nr_shards; i++) {
+		objp = mmempool_alloc(arena->shard[idx], size);
+		if (objp)
+			return objp;
+		pr_info("shard %u exhausted, steal from next\n", idx);
+		if (++idx == arena->nr_shards)
+			idx = 0;
+	}
+	return NULL;
+}
+
+void *mmempool_arena_alloc_aligned(mmempool_arena_t *arena, uint32_t size, uint32_t align)
+{
+	uint32_t i, idx;
+	void *objp;
+
+	if (!arena)
+		return NULL;
+	idx = mmempool_arena_shard(arena);
+	for (i = 0; i < arena->nr_shards; i++) {
+		objp = mmempool_alloc_aligned(arena->shard[idx], size, align);
+		if (objp)
+			return objp;
+		if (++idx == arena->nr_shards)
+			idx = 0;
+	}
+	return NULL;
+}
+
+void mmempool_arena_free(mmempool_arena_t *arena, void *objp)
+{
+	size_t off;
+
+	if (!arena || !objp)
+		return;
+	off = (char *)objp - (char *)arena->mem;
+	if (off >= (size_t)arena->shard_size * arena->nr_shards)
+		return;
+	mmempool_free(arena->shard[off / arena->shard_size], objp);
+}
+
+/*
+ * 先在objp所在的分片内调整, 分片内存不足时从arena重新分配并拷贝
+ */
+void *mmempool_arena_realloc(mmempool_arena_t *arena, void *objp, uint32_t size)
+{
+	mmempool_t *shard;
+	uint32_t old;
+	size_t off;
+	void *newp;
+	int err;
+
+	if (!arena)
+		return NULL;
+	if (!objp)
+		return mmempool_arena_alloc(arena, size);
+	off = (char *)objp - (char *)arena->mem;
+	if (off >= (size_t)arena->shard_size * arena->nr_shards)
+		return NULL;
+	if (!size) {
+		mmempool_arena_free(arena, objp);
+		return NULL;
+	}
+	shard = arena->shard[off / arena->shard_size];
+	newp = mmem_realloc(shard, objp, size, &err);
+	/* 只有本分片放不下时才换分片, objp无效时不分配 */
+	if (newp || err != -ENOMEM)
+		return newp;
+	newp = mmempool_arena_alloc(arena, size);
+	if (!newp)
+		return NULL;
+	old = mmempool_usable_size(shard, objp);
+	memcpy(newp, objp, min_t(uint32_t, old, size));
+	mmempool_free(shard, objp);
+
+	return newp;
+}
+
+uint32_t mmempool_arena_usable_size(mmempool_arena_t *arena, void *objp)
+{
+	size_t off;
+
+	if (!arena || !objp)
+		return 0;
+	off = (char *)objp - (char *)arena->mem;
+	if (off >= (size_t)arena->shard_size * arena->nr_shards)
+		return 0;
+	return mmempool_usable_size(arena->shard[off / arena->shard_size], objp);
+}
+
+/*
+ * 所有分片统计之和, 任何一个分片出错时返回第一个错误(其余分片仍然累加).
+ * high_water为各分片峰值之和, 是整体峰值的上界
+ */
+int mmempool_arena_get_stats(mmempool_arena_t *arena, mempool_stats_t *st)
+{
+	mempool_stats_t tmp;
+	uint32_t i, j;
+	int ret = 0, err;
+
+	if (!arena || !st)
+		return -EINVAL;
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < arena->nr_shards; i++) {
+		err = mmempool_get_stats(arena->shard[i], &tmp);
+		if (err && !ret)
+			ret = err;
+		st->allocs += tmp.allocs;
+		st->frees += tmp.frees;
+		st->failures += tmp.failures;
+		st->contended += tmp.contended;
+		st->inuse += tmp.inuse;
+		st->high_water += tmp.high_water;
+		st->errors += tmp.errors;
+		for (j = 0; j < MEMPOOL_STAT_ORDERS; j++)
+			st->order_allocs[j] += tmp.order_allocs[j];
+		for (j = 0; j < MMEMPOOL_SLAB_CLASSES; j++)
+			st->class_allocs[j] += tmp.class_allocs[j];
+	}
+	return ret;
+}
+
+/* 按分片顺序持有所有分片的锁, 见smempool_lock */
+void mmempool_arena_lock(mmempool_arena_t *arena)
+{
+	uint32_t i;
+
+	if (!arena)
+		return;
+	for (i = 0; i < arena->nr_shards; i++)
+		mempool_lock(&arena->shard[i]->lock);
+}
+
+void mmempool_arena_unlock(mmempool_arena_t *arena)
+{
+	uint32_t i;
+
+	if (!arena)
+		return;
+	for (i = arena->nr_shards; i > 0; i--)
+		mempool_unlock(&arena->shard[i - 1]->lock);
 }
@@ -14,24 +14,159 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#ifdef __cplusplus
+/* list.h is kernel style C ('new' as identifier, typeof), C++ only needs the type */
+struct list_head {
+	struct list_head *next, *prev;
+};
+#else
 #include "list.h"
+#endif
 #include <semaphore.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define MEMPOOL_VERSION		"0.0.1"
 #define MEMPOOL_DATE		"2017-10-12"
 
+/* create flags */
+#define MEMPOOL_F_MAGAZINE	0x00000001	/* smempool: per-thread magazine cache */
+#define MEMPOOL_F_LOCKFREE	0x00000002	/* smempool: CAS free list, no lock */
+#define MEMPOOL_F_BUDDY		0x00000004	/* mmempool: XOR buddy coalescing */
+#define MEMPOOL_F_SIZE_CLASS	0x00000008	/* mmempool: slab size classes for small requests */
+#define MEMPOOL_F_STATS		0x00000010	/* keep per-thread sharded statistics */
+#define MEMPOOL_F_MMAP		0x00000020	/* back with anonymous mmap instead of malloc */
+#define MEMPOOL_F_HUGETLB	0x00000040	/* mmap with MAP_HUGETLB, falls back to THP */
+#define MEMPOOL_F_THP		0x00000080	/* 2M aligned mmap + MADV_HUGEPAGE */
+#define MEMPOOL_F_POPULATE	0x00000100	/* pre-fault the whole region */
+#define MEMPOOL_F_SHARED	0x00000200	/* smempool: cross-process, see smempool_attach */
+#define MEMPOOL_F_GROW		0x00000400	/* smempool: chain extra slabs when exhausted */
+#define MEMPOOL_F_OOB		0x00000800	/* mmempool: chunk metadata in a side table, implies BUDDY */
+#define MEMPOOL_F_REMOTE_FREE	0x00001000	/* smempool: owner thread allocates, others free via MPSC queue */
+#define MEMPOOL_F_HWCACHE_ALIGN	0x00002000	/* smempool: every element on its own cachelines */
+#define MEMPOOL_F_COLOR		0x00004000	/* smempool: per-slab color offset, pad 2^n strides */
+#define MEMPOOL_F_BITMAP	0x00008000	/* smempool: hierarchical free bitmap instead of bufctl */
+#define MEMPOOL_F_DEBUG		0x10000000	/* red zones, poison and quarantine, bad frees reported on stderr */
+#define MEMPOOL_F_DEBUG_ALL	0x20000000	/* with MEMPOOL_F_DEBUG: poison and quarantine every free, not sampled */
+
+/* bind the mmap'd region to NUMA node n */
+#define MEMPOOL_NUMA_SHIFT	16
+#define MEMPOOL_F_NUMA_NODE(n)	((uint32_t)((n) + 1) << MEMPOOL_NUMA_SHIFT)
+#define MEMPOOL_NUMA_NODE(flags)	((int)(((flags) >> MEMPOOL_NUMA_SHIFT) & 0xff) - 1)
+
+/* where the pool memory came from */
+enum {
+	MEMPOOL_MEM_EXTERNAL = 0,	/* caller's mem_ptr */
+	MEMPOOL_MEM_MALLOC,
+	MEMPOOL_MEM_MMAP,
+	MEMPOOL_MEM_HUGETLB,
+};
+
+/* lock backend, selected with MEMPOOL_F_LOCK(type) in create flags */
+enum {
+	MEMPOOL_LOCK_SEM = 0,		/* POSIX unnamed semaphore (default) */
+	MEMPOOL_LOCK_SPIN,		/* pthread spinlock */
+	MEMPOOL_LOCK_MUTEX,		/* adaptive pthread mutex */
+	MEMPOOL_LOCK_TICKET,		/* FIFO ticket spinlock */
+	MEMPOOL_LOCK_NONE,		/* single-threaded owner */
+};
+#define MEMPOOL_LOCK_SHIFT	24
+#define MEMPOOL_LOCK_MASK	(0xfU << MEMPOOL_LOCK_SHIFT)
+#define MEMPOOL_F_LOCK(type)	((uint32_t)(type) << MEMPOOL_LOCK_SHIFT)
+#define MEMPOOL_LOCK_TYPE(flags)	(((flags) & MEMPOOL_LOCK_MASK) >> MEMPOOL_LOCK_SHIFT)
+
+#define SMEMPOOL_MAGAZINE_SIZE	32		/* entries per thread magazine */
+#define SMEMPOOL_BITMAP_LEVELS	4		/* MEMPOOL_F_BITMAP, 64^4 elements under one top word */
+#define MEMPOOL_QUARANTINE	64		/* MEMPOOL_F_DEBUG: sampled frees held back before reuse */
+#define MMEMPOOL_QUARANTINE_SHIFT	4	/* MEMPOOL_F_DEBUG: mmempool quarantine holds at most mem_size >> n bytes */
+#define MEMPOOL_DEBUG_SAMPLE	32		/* MEMPOOL_F_DEBUG: poison and quarantine one in n frees, mempool_set_debug_sample(1) for all */
+
+#define MMEMPOOL_SLAB_CLASSES	6		/* 16, 32 ... 512 bytes */
+#define MMEMPOOL_SLAB_MAX	512
+
+#define MEMPOOL_STAT_ORDERS	22		/* kbytes order 0 ... 21 */
+
+#define MMEMPOOL_ALIGN		16		/* alignment of mmempool_alloc results */
+
+#define MEMPOOL_CACHE_LINE	64
+
 typedef unsigned int smem_bufctl_t;
 
+struct mempool_counters;
+struct mempool_quarantine;
+struct smem_grow;
+
+/*
+ * snapshot returned by smempool_get_stats/mmempool_get_stats.
+ * MEMPOOL_F_REMOTE_FREE: elements freed by other threads leave inuse only
+ * when the owner drains them; smempool_get_stats drains first when called
+ * by the owner, from other threads inuse may be high.
+ */
+typedef struct mempool_stats {
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t failures;
+	uint64_t contended;		/* lock acquisitions that had to wait */
+	uint64_t inuse;			/* smempool: elements, mmempool: bytes */
+	uint64_t high_water;		/* max inuse seen */
+	uint64_t errors;		/* MEMPOOL_F_DEBUG: bad frees and corruption reported */
+	uint64_t order_allocs[MEMPOOL_STAT_ORDERS];
+	uint64_t class_allocs[MMEMPOOL_SLAB_CLASSES];
+}mempool_stats_t;
+
+typedef struct mempool_lock {
+	uint32_t type;
+	union {
+		sem_t sem;
+		pthread_spinlock_t spin;
+		pthread_mutex_t mutex;
+		struct {
+			uint32_t next, owner;
+		} ticket;
+	};
+}mempool_lock_t;
+
+/* precomputed 1/ele_asize, obj_to_index multiplies instead of dividing */
+struct mempool_reciprocal {
+	uint32_t m;
+	uint8_t sh1, sh2;
+	uint8_t pow2;			/* ele_asize is 2^sh2, plain shift */
+};
+
 typedef struct smempool {
-	void *smem;
+	uint32_t magic;
+	uint32_t smem_off;		/* elements, offset from the header */
 	uint32_t mem_size;
-	sem_t sem;
+	mempool_lock_t lock;
 	uint32_t align;
 	uint32_t ele_ssize;		/* element source size */
 	uint32_t ele_asize;		/* element adjust size */
+	struct mempool_reciprocal ele_recip;
 	uint32_t ele_num;
 	smem_bufctl_t free;
 	uint32_t inuse;
+	uint64_t head;			/* MEMPOOL_F_LOCKFREE: {tag, free} */
+	uint32_t flags;
+	pid_t creator;			/* MEMPOOL_F_SHARED: only this process may destroy */
+	/*
+	 * process-private state, the flags that use it are rejected with
+	 * MEMPOOL_F_SHARED, so other processes never follow these pointers
+	 */
+	pthread_key_t mag_key;		/* per-thread magazine */
+	struct list_head magazines;	/* all magazines, for destroy */
+	struct mempool_counters *stats;	/* MEMPOOL_F_STATS */
+	uint32_t backing;		/* MEMPOOL_MEM_* */
+	struct smem_grow *grow;		/* MEMPOOL_F_GROW */
+	struct mempool_quarantine *quarantine;	/* MEMPOOL_F_DEBUG */
+	uint32_t bm_levels;		/* MEMPOOL_F_BITMAP, see smem_bm_get */
+	uint32_t bm_top;		/* words in the top level */
+	uint32_t bm_off[SMEMPOOL_BITMAP_LEVELS];	/* level offsets, in uint64_t after the header */
+	pthread_t owner;		/* MEMPOOL_F_REMOTE_FREE: the allocating thread */
+	/* MEMPOOL_F_REMOTE_FREE: indices freed by other threads, linked through bufctl, own cache line */
+	smem_bufctl_t *remote;
 }smempool_t;
 
 struct chunk {
@@ -50,10 +185,30 @@ typedef struct mmempool {
 	uint32_t order_max;		/* kbytes max order */
 	uint32_t order_min;		/* kbytes min order */
 	struct free_area *free_area;
-	uint32_t external_mem;
-	sem_t sem;
+	uint32_t free_map;		/* bit n: free_area[n] not empty */
+	size_t free_bytes;
+	uint32_t backing;		/* MEMPOOL_MEM_* */
+	uint32_t flags;
+	mempool_lock_t lock;
+	struct list_head slab_partial[MMEMPOOL_SLAB_CLASSES];
+	uint8_t slab_order[MMEMPOOL_SLAB_CLASSES];
+	uint8_t *slab_map;		/* per min-order block, see mslab_lookup */
+	uint8_t *oob_map;		/* MEMPOOL_F_OOB: per min-order block, see oob_lookup */
+	struct list_head *oob_list;	/* MEMPOOL_F_OOB: free_area links, per min-order block */
+	struct mempool_counters *stats;	/* MEMPOOL_F_STATS */
+	struct mempool_quarantine *quarantine;	/* MEMPOOL_F_DEBUG */
 }mmempool_t;
 
+/* per-CPU shards of one backing region, see mmempool_arena_create */
+typedef struct mmempool_arena {
+	void *mem;
+	uint32_t mem_size;
+	uint32_t shard_size;
+	uint32_t nr_shards;
+	uint32_t backing;		/* MEMPOOL_MEM_* */
+	mmempool_t **shard;
+}mmempool_arena_t;
+
 enum {
 	MEMPOOL_PRINT_LEVEL_EMERG = -1,
 	MEMPOOL_PRINT_LEVEL_VERBOSE = 0,
@@ -64,18 +219,57 @@ enum {
 
 
 smempool_t *smempool_create(void *mem_ptr, uint32_t mem_size, uint32_t element_size, uint32_t align);
+smempool_t *smempool_create_ex(void *mem_ptr, uint32_t mem_size, uint32_t element_size, uint32_t align, uint32_t flags);
 void smempool_destroy(smempool_t *mempool);
 void *smempool_alloc(smempool_t *mempool);
 void smempool_free(smempool_t *mempool, void *objp);
+uint32_t smempool_alloc_bulk(smempool_t *mempool, void **objs, uint32_t n);
+void smempool_free_bulk(smempool_t *mempool, void **objs, uint32_t n);
+int smempool_get_stats(smempool_t *mempool, mempool_stats_t *st);
+smempool_t *smempool_attach(void *mem_ptr, uint32_t mem_size);
+int smempool_detach(smempool_t *mempool);
+uint32_t smempool_ptr2off(smempool_t *mempool, void *objp);
+void *smempool_off2ptr(smempool_t *mempool, uint32_t offset);
+int smempool_verify_index(smempool_t *mempool);
+int smempool_set_idle(smempool_t *mempool, uint32_t idle_ms);
+uint32_t smempool_shrink(smempool_t *mempool);
+void smempool_lock(smempool_t *mempool);
+void smempool_unlock(smempool_t *mempool);
+int smempool_set_owner(smempool_t *mempool);
 
 mmempool_t *mmempool_create(void *mem_ptr, uint32_t mem_size, uint32_t order_min, uint32_t order_max);
+mmempool_t *mmempool_create_ex(void *mem_ptr, uint32_t mem_size, uint32_t order_min, uint32_t order_max, uint32_t flags);
 void mmempool_destroy(mmempool_t *mempool);
-void *mmempool_alloc(mmempool_t *mempool, uint32_t kbsize);
+void *mmempool_alloc(mmempool_t *mempool, uint32_t size);
+void *mmempool_alloc_aligned(mmempool_t *mempool, uint32_t size, uint32_t align);
 void mmempool_free(mmempool_t *mempool, void *objp);
+uint32_t mmempool_alloc_bulk(mmempool_t *mempool, uint32_t size, void **objs, uint32_t n);
+void mmempool_free_bulk(mmempool_t *mempool, void **objs, uint32_t n);
+void *mmempool_realloc(mmempool_t *mempool, void *objp, uint32_t size);
+uint32_t mmempool_usable_size(mmempool_t *mempool, void *objp);
 uint32_t mmempool_remain_size(mmempool_t *mempool);
+uint32_t mmempool_overhead(mmempool_t *mempool);
+int mmempool_get_stats(mmempool_t *mempool, mempool_stats_t *st);
 
 void mmempool_dump(mmempool_t *mempool);
 
+mmempool_arena_t *mmempool_arena_create(void *mem_ptr, uint32_t mem_size, uint32_t order_min, uint32_t order_max,
+		uint32_t nr_shards, uint32_t flags);
+void mmempool_arena_destroy(mmempool_arena_t *arena);
+void *mmempool_arena_alloc(mmempool_arena_t *arena, uint32_t size);
+void *mmempool_arena_alloc_aligned(mmempool_arena_t *arena, uint32_t size, uint32_t align);
+void mmempool_arena_free(mmempool_arena_t *arena, void *objp);
+void *mmempool_arena_realloc(mmempool_arena_t *arena, void *objp, uint32_t size);
+uint32_t mmempool_arena_usable_size(mmempool_arena_t *arena, void *objp);
+int mmempool_arena_get_stats(mmempool_arena_t *arena, mempool_stats_t *st);
+void mmempool_arena_lock(mmempool_arena_t *arena);
+void mmempool_arena_unlock(mmempool_arena_t *arena);
+
 void mempool_set_debug_level(int level);
+void mempool_set_debug_sample(uint32_t n);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
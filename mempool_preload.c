@@ -0,0 +1,592 @@
+/*
+ * LD_PRELOAD malloc replacement built on smempool/mmempool.
+ *
+ * Author: ForeverCai <gdzhforever@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "mempool.h"
+
+/*
+ * 使用方法:
+ *	make preload
+ *	LD_PRELOAD=./libmempool_preload.so <program>
+ *
+ * 每个分配前有16字节的头部(struct pl_hdr), 释放时据此找到来源:
+ *	<= PL_SMEM_MAX	每线程smempool size class(可增长, spin锁, mmap后备),
+ *			其他线程释放时加该smempool的锁
+ *	<= pl_arena_max	按CPU分片的mmempool arena
+ *	其余		直接mmap
+ * 内存池本身需要的元数据在pl_busy期间分配, 来自静态的pl_boot区,
+ * 避免递归进入malloc.
+ *
+ * 环境变量:
+ *	MEMPOOL_PRELOAD_ARENA_MB	arena大小, 默认256
+ *	MEMPOOL_PRELOAD_STATS		进程退出时向stderr输出统计
+ */
+
+#define PL_HDR_SIZE		16
+#define PL_ALIGN		16
+#define PL_MAGIC		0x4d500000U
+#define PL_MAGIC_MASK		0xfff00000U
+
+enum {
+	PL_KIND_SMEM = 1,
+	PL_KIND_ARENA,
+	PL_KIND_MMAP,
+	PL_KIND_BOOT,
+	PL_KIND_ALIGNED,	/* memalign的假头部, pool指向原始分配 */
+};
+
+struct pl_hdr {
+	union {
+		void *pool;		/* SMEM: smempool_t *, ALIGNED: 原始指针 */
+		size_t len;		/* MMAP: 映射长度 */
+	};
+	uint32_t size;			/* SMEM/ARENA/BOOT: 可用字节数 */
+	uint32_t kind;			/* PL_MAGIC | PL_KIND_* */
+};
+
+#define PL_HDR(p)		((struct pl_hdr *)((char *)(p) - PL_HDR_SIZE))
+#define PL_MEM(h)		((void *)((char *)(h) + PL_HDR_SIZE))
+#define PL_KIND(h)		((h)->kind & ~PL_MAGIC_MASK)
+#define PL_VALID(h)		(((h)->kind & PL_MAGIC_MASK) == PL_MAGIC)
+#define PL_ALIGN_UP(n, a)	(((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+/* smempool size class, 元素大小包含头部 */
+static const uint32_t pl_class_size[] = {
+	32, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 512, 640, 768, 1024,
+};
+#define PL_NR_CLASSES		(sizeof(pl_class_size)/sizeof(pl_class_size[0]))
+#define PL_SMEM_MAX		(1024 - PL_HDR_SIZE)
+#define PL_SMEM_SIZE		(64 << 10)	/* 每个线程每个class的初始内存 */
+
+#define PL_ORDER_MIN		0		/* 1K */
+#define PL_ORDER_MAX		10		/* 1M */
+#define PL_ARENA_MB		256
+#define PL_MAX_SHARDS		16
+
+#define PL_BOOT_SIZE		(4 << 20)
+
+struct pl_tcache {
+	smempool_t *pool[PL_NR_CLASSES];
+	struct pl_tcache *next;		/* 退出线程留下的cache, 由新线程接管 */
+	struct pl_tcache *all;		/* 所有cache, fork时逐个加锁 */
+};
+
+#define PL_TLS	__attribute__((tls_model("initial-exec")))
+
+static __thread int pl_busy PL_TLS;
+static __thread struct pl_tcache *pl_tc PL_TLS;
+
+static uint8_t pl_class_map[PL_SMEM_MAX/PL_ALIGN + 2];
+static mmempool_arena_t *pl_arena;
+static uint32_t pl_arena_max;		/* arena能分配的最大size, 不含pl_hdr */
+static pthread_key_t pl_key;
+static int pl_state;			/* 0: 未初始化, 1: 初始化中, 2: 完成 */
+static int pl_stats;
+
+/* pl_lock保护pl_orphan, pl_all和tcache中smempool的创建 */
+static struct pl_tcache *pl_orphan, *pl_all;
+static int pl_lock;
+
+static char pl_boot[PL_BOOT_SIZE] __attribute__((aligned(64)));
+static size_t pl_boot_used;
+
+static uint64_t pl_mmap_count, pl_mmap_bytes, pl_tcache_count;
+
+static inline void pl_spin_lock(int *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static inline void pl_spin_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline void *pl_hdr_init(struct pl_hdr *h, void *pool, uint32_t size, uint32_t kind)
+{
+	h->pool = pool;
+	h->size = size;
+	h->kind = PL_MAGIC | kind;
+	return PL_MEM(h);
+}
+
+static void *pl_mmap_alloc(size_t size)
+{
+	struct pl_hdr *h;
+	size_t len;
+
+	if (size > SIZE_MAX - PL_HDR_SIZE - (size_t)sysconf(_SC_PAGESIZE))
+		return NULL;
+	len = PL_ALIGN_UP(size + PL_HDR_SIZE, sysconf(_SC_PAGESIZE));
+	h = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (h == MAP_FAILED)
+		return NULL;
+	h->len = len;
+	h->size = 0;
+	h->kind = PL_MAGIC | PL_KIND_MMAP;
+	if (pl_stats) {
+		__atomic_add_fetch(&pl_mmap_count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&pl_mmap_bytes, len, __ATOMIC_RELAXED);
+	}
+	return PL_MEM(h);
+}
+
+/* 内存池元数据, 不释放 */
+static void *pl_boot_alloc(size_t size)
+{
+	size_t need, off;
+
+	if (size > PL_BOOT_SIZE)
+		return pl_mmap_alloc(size);
+	need = PL_ALIGN_UP(size + PL_HDR_SIZE, PL_ALIGN);
+	off = __atomic_fetch_add(&pl_boot_used, need, __ATOMIC_RELAXED);
+	if (off + need > PL_BOOT_SIZE)
+		return pl_mmap_alloc(size);
+	return pl_hdr_init((struct pl_hdr *)(pl_boot + off), NULL, need - PL_HDR_SIZE, PL_KIND_BOOT);
+}
+
+static void pl_thread_exit(void *arg)
+{
+	struct pl_tcache *tc = arg;
+
+	pl_spin_lock(&pl_lock);
+	tc->next = pl_orphan;
+	pl_orphan = tc;
+	pl_spin_unlock(&pl_lock);
+	pl_tc = NULL;
+}
+
+/*
+ * fork时其他线程可能正持有内存池的锁, 子进程中不会再有人释放.
+ * fork前在调用线程中取得所有锁, 父子进程中各自释放; pl_busy让fork
+ * 期间libc内部的分配走pl_boot, 不再进入内存池
+ */
+static void pl_atfork_prepare(void)
+{
+	struct pl_tcache *tc;
+	uint32_t cls;
+
+	pl_busy++;
+	pl_spin_lock(&pl_lock);
+	for (tc = pl_all; tc; tc = tc->all) {
+		for (cls = 0; cls < PL_NR_CLASSES; cls++)
+			smempool_lock(tc->pool[cls]);
+	}
+	mmempool_arena_lock(pl_arena);
+}
+
+static void pl_atfork_release(void)
+{
+	struct pl_tcache *tc;
+	uint32_t cls;
+
+	mmempool_arena_unlock(pl_arena);
+	for (tc = pl_all; tc; tc = tc->all) {
+		for (cls = 0; cls < PL_NR_CLASSES; cls++)
+			smempool_unlock(tc->pool[cls]);
+	}
+	pl_spin_unlock(&pl_lock);
+	pl_busy--;
+}
+
+static void pl_init(void)
+{
+	uint32_t i, cls, shards, mb;
+	const char *env;
+	long cpus;
+	int state = 0;
+
+	if (!__atomic_compare_exchange_n(&pl_state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&pl_state, __ATOMIC_ACQUIRE) != 2)
+			sched_yield();
+		return;
+	}
+	pl_busy++;
+	for (i = 0, cls = 0; i < sizeof(pl_class_map); i++) {
+		while (cls < PL_NR_CLASSES && pl_class_size[cls] < i * PL_ALIGN + PL_HDR_SIZE)
+			cls++;
+		pl_class_map[i] = cls;
+	}
+	pl_stats = getenv("MEMPOOL_PRELOAD_STATS") != NULL;
+	env = getenv("MEMPOOL_PRELOAD_ARENA_MB");
+	mb = env ? (uint32_t)atoi(env) : PL_ARENA_MB;
+	if (mb > 4095)
+		mb = 4095;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	shards = cpus > 0 ? (cpus < PL_MAX_SHARDS ? cpus : PL_MAX_SHARDS) : 1;
+	if (mb)
+		pl_arena = mmempool_arena_create(NULL, mb << 20, PL_ORDER_MIN, PL_ORDER_MAX, shards,
+				MEMPOOL_F_MMAP | MEMPOOL_F_LOCK(MEMPOOL_LOCK_SPIN) | (pl_stats ? MEMPOOL_F_STATS : 0));
+	if (pl_arena)
+		pl_arena_max = (1U << (PL_ORDER_MAX + 10)) - mmempool_overhead(pl_arena->shard[0]) - PL_HDR_SIZE;
+	pthread_key_create(&pl_key, pl_thread_exit);
+	pthread_atfork(pl_atfork_prepare, pl_atfork_release, pl_atfork_release);
+	pl_busy--;
+	__atomic_store_n(&pl_state, 2, __ATOMIC_RELEASE);
+}
+
+static struct pl_tcache *pl_tcache(void)
+{
+	struct pl_tcache *tc = pl_tc;
+
+	if (tc)
+		return tc;
+	pl_busy++;
+	pl_spin_lock(&pl_lock);
+	tc = pl_orphan;
+	if (tc)
+		pl_orphan = tc->next;
+	pl_spin_unlock(&pl_lock);
+	if (!tc) {
+		tc = pl_boot_alloc(sizeof(struct pl_tcache));
+		if (tc) {
+			memset(tc, 0, sizeof(struct pl_tcache));
+			__atomic_add_fetch(&pl_tcache_count, 1, __ATOMIC_RELAXED);
+			pl_spin_lock(&pl_lock);
+			tc->all = pl_all;
+			pl_all = tc;
+			pl_spin_unlock(&pl_lock);
+		}
+	}
+	if (tc) {
+		pthread_setspecific(pl_key, tc);
+		pl_tc = tc;
+	}
+	pl_busy--;
+
+	return tc;
+}
+
+static void *pl_smem_alloc(size_t size)
+{
+	struct pl_tcache *tc;
+	smempool_t *pool;
+	uint32_t cls;
+	void *objp;
+
+	cls = pl_class_map[(size + PL_ALIGN - 1) / PL_ALIGN];
+	tc = pl_tcache();
+	if (!tc)
+		return NULL;
+	pool = tc->pool[cls];
+	if (!pool) {
+		/* 在pl_lock内创建, fork时pl_atfork_prepare不会漏掉 */
+		pl_busy++;
+		pl_spin_lock(&pl_lock);
+		pool = smempool_create_ex(NULL, PL_SMEM_SIZE, pl_class_size[cls], PL_ALIGN,
+				MEMPOOL_F_GROW | MEMPOOL_F_MMAP | MEMPOOL_F_LOCK(MEMPOOL_LOCK_SPIN));
+		tc->pool[cls] = pool;
+		pl_spin_unlock(&pl_lock);
+		pl_busy--;
+		if (!pool)
+			return NULL;
+	}
+	pl_busy++;
+	objp = smempool_alloc(pool);
+	pl_busy--;
+	if (!objp)
+		return NULL;
+	return pl_hdr_init(objp, pool, pl_class_size[cls] - PL_HDR_SIZE, PL_KIND_SMEM);
+}
+
+static void *pl_arena_alloc(size_t size)
+{
+	void *objp;
+
+	pl_busy++;
+	objp = mmempool_arena_alloc(pl_arena, size + PL_HDR_SIZE);
+	pl_busy--;
+	if (!objp)
+		return NULL;
+	return pl_hdr_init(objp, pl_arena, mmempool_arena_usable_size(pl_arena, objp) - PL_HDR_SIZE, PL_KIND_ARENA);
+}
+
+static void *pl_malloc(size_t size)
+{
+	void *p = NULL;
+
+	if (pl_busy)
+		return pl_boot_alloc(size);
+	if (__atomic_load_n(&pl_state, __ATOMIC_ACQUIRE) != 2)
+		pl_init();
+	if (size <= PL_SMEM_MAX)
+		p = pl_smem_alloc(size);
+	if (!p && pl_arena && size <= pl_arena_max)
+		p = pl_arena_alloc(size);
+	if (!p)
+		p = pl_mmap_alloc(size);
+	if (!p)
+		errno = ENOMEM;
+	return p;
+}
+
+static size_t pl_usable_size(void *p)
+{
+	struct pl_hdr *h = PL_HDR(p);
+
+	switch (PL_KIND(h)) {
+		case PL_KIND_MMAP:
+			return h->len - PL_HDR_SIZE;
+		case PL_KIND_ALIGNED:
+			return pl_usable_size(h->pool) - ((char *)p - (char *)h->pool);
+		default:
+			return h->size;
+	}
+}
+
+static void pl_free(void *p)
+{
+	struct pl_hdr *h;
+
+	if (!p)
+		return;
+	h = PL_HDR(p);
+	if (!PL_VALID(h))
+		return;
+	switch (PL_KIND(h)) {
+		case PL_KIND_SMEM:
+			pl_busy++;
+			smempool_free(h->pool, h);
+			pl_busy--;
+			break;
+		case PL_KIND_ARENA:
+			pl_busy++;
+			mmempool_arena_free(h->pool, h);
+			pl_busy--;
+			break;
+		case PL_KIND_MMAP:
+			if (pl_stats) {
+				__atomic_sub_fetch(&pl_mmap_count, 1, __ATOMIC_RELAXED);
+				__atomic_sub_fetch(&pl_mmap_bytes, h->len, __ATOMIC_RELAXED);
+			}
+			munmap(h, h->len);
+			break;
+		case PL_KIND_ALIGNED:
+			pl_free(h->pool);
+			break;
+		case PL_KIND_BOOT:
+			break;
+	}
+}
+
+static void *pl_memalign(size_t align, size_t size)
+{
+	char *raw, *p;
+
+	if (align <= PL_ALIGN)
+		return pl_malloc(size);
+	if (align & (align - 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (size > SIZE_MAX - align) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	/* 多分配align字节, 在对齐后的地址前放一个假头部 */
+	raw = pl_malloc(size + align);
+	if (!raw)
+		return NULL;
+	p = (char *)PL_ALIGN_UP((uintptr_t)raw, align);
+	if (p == raw)
+		return raw;
+	return pl_hdr_init(PL_HDR(p), raw, 0, PL_KIND_ALIGNED);
+}
+
+static void *pl_realloc(void *p, size_t size)
+{
+	struct pl_hdr *h;
+	size_t usable, len;
+	void *newp;
+
+	if (!p)
+		return pl_malloc(size);
+	if (!size) {
+		pl_free(p);
+		return NULL;
+	}
+	h = PL_HDR(p);
+	/* arena中的块原地增大/缩小, 见mmempool_realloc */
+	if (PL_KIND(h) == PL_KIND_ARENA && size > PL_SMEM_MAX && size <= pl_arena_max) {
+		pl_busy++;
+		newp = mmempool_arena_realloc(pl_arena, h, size + PL_HDR_SIZE);
+		pl_busy--;
+		if (newp) {
+			h = newp;
+			h->size = mmempool_arena_usable_size(pl_arena, h) - PL_HDR_SIZE;
+			return PL_MEM(h);
+		}
+	}
+	usable = pl_usable_size(p);
+	if (size <= usable && (PL_KIND(h) != PL_KIND_MMAP || size > usable / 2))
+		return p;
+	/* 大块直接mremap, 不需要拷贝 */
+	if (PL_KIND(h) == PL_KIND_MMAP && size > pl_arena_max &&
+	    size <= SIZE_MAX - PL_HDR_SIZE - (size_t)sysconf(_SC_PAGESIZE)) {
+		len = PL_ALIGN_UP(size + PL_HDR_SIZE, sysconf(_SC_PAGESIZE));
+		newp = mremap(h, h->len, len, MREMAP_MAYMOVE);
+		if (newp != MAP_FAILED) {
+			if (pl_stats)
+				__atomic_add_fetch(&pl_mmap_bytes, len - ((struct pl_hdr *)newp)->len, __ATOMIC_RELAXED);
+			((struct pl_hdr *)newp)->len = len;
+			return PL_MEM(newp);
+		}
+	}
+	newp = pl_malloc(size);
+	if (!newp)
+		return NULL;
+	memcpy(newp, p, usable < size ? usable : size);
+	pl_free(p);
+	return newp;
+}
+
+static void pl_print(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void pl_print(const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		write(STDERR_FILENO, buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+}
+
+__attribute__((destructor))
+static void pl_fini(void)
+{
+	mempool_stats_t st;
+	uint64_t remain = 0;
+	uint32_t i;
+
+	if (!pl_stats || !pl_arena)
+		return;
+	mmempool_arena_get_stats(pl_arena, &st);
+	for (i = 0; i < pl_arena->nr_shards; i++)
+		remain += mmempool_remain_size(pl_arena->shard[i]);
+	pl_print("mempool_preload: arena allocs=%llu frees=%llu failures=%llu contended=%llu\n",
+		(unsigned long long)st.allocs, (unsigned long long)st.frees,
+		(unsigned long long)st.failures, (unsigned long long)st.contended);
+	pl_print("mempool_preload: arena inuse=%llu high_water=%llu free=%llu size=%u\n",
+		(unsigned long long)st.inuse, (unsigned long long)st.high_water,
+		(unsigned long long)remain, pl_arena->mem_size);
+	pl_print("mempool_preload: mmap count=%llu bytes=%llu, thread caches=%llu, boot=%zu\n",
+		(unsigned long long)pl_mmap_count, (unsigned long long)pl_mmap_bytes,
+		(unsigned long long)pl_tcache_count, pl_boot_used);
+}
+
+/*
+ * 导出的接口
+ */
+void *malloc(size_t size)
+{
+	return pl_malloc(size);
+}
+
+void free(void *p)
+{
+	pl_free(p);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	struct pl_hdr *h;
+	size_t total;
+	void *p;
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	p = pl_malloc(total);
+	if (!p)
+		return NULL;
+	h = PL_HDR(p);
+	/* 新映射的内存已经是0 */
+	if (PL_KIND(h) != PL_KIND_MMAP)
+		memset(p, 0, total);
+	return p;
+}
+
+void *realloc(void *p, size_t size)
+{
+	return pl_realloc(p, size);
+}
+
+void *reallocarray(void *p, size_t nmemb, size_t size)
+{
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return pl_realloc(p, total);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+	void *p;
+
+	if (!align || (align & (align - 1)) || (align % sizeof(void *)))
+		return EINVAL;
+	p = pl_memalign(align, size);
+	if (!p)
+		return ENOMEM;
+	*memptr = p;
+	return 0;
+}
+
+void *memalign(size_t align, size_t size)
+{
+	return pl_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	return pl_memalign(align, size);
+}
+
+void *valloc(size_t size)
+{
+	return pl_memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (size > SIZE_MAX - page) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return pl_memalign(page, PL_ALIGN_UP(size ? size : 1, page));
+}
+
+size_t malloc_usable_size(void *p)
+{
+	if (!p || !PL_VALID(PL_HDR(p)))
+		return 0;
+	return pl_usable_size(p);
+}
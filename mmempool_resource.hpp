@@ -0,0 +1,110 @@
+/*
+ * std::pmr::memory_resource backed by mmempool.
+ *
+ * Author: ForeverCai <gdzhforever@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ */
+#ifndef __MMEMPOOL_RESOURCE_HPP_
+#define __MMEMPOOL_RESOURCE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+
+#include "mempool.h"
+
+/*
+ * pmr容器(pmr::vector, pmr::unordered_map, pmr::string...)从预先申请的
+ * mmempool内存中分配. 默认打开MEMPOOL_F_SIZE_CLASS, 512字节以下的请求
+ * 由mmempool的size class slab分配, 其余按buddy order分配, 对齐超过
+ * MMEMPOOL_ALIGN的请求走mmempool_alloc_aligned.
+ * 超过最大order或者内存池用完时交给upstream;
+ * 需要严格只用内存池时upstream传std::pmr::null_memory_resource().
+ */
+namespace mempool {
+
+class mmempool_resource : public std::pmr::memory_resource {
+public:
+	static constexpr uint32_t default_flags = MEMPOOL_F_SIZE_CLASS | MEMPOOL_F_LOCK(MEMPOOL_LOCK_MUTEX);
+
+	/* 内存由mmempool申请, mem_size/order同mmempool_create_ex */
+	mmempool_resource(uint32_t mem_size, uint32_t order_min, uint32_t order_max,
+			  uint32_t flags = default_flags,
+			  std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+		: mmempool_resource(nullptr, mem_size, order_min, order_max, flags, upstream) {}
+
+	/* 使用调用者的内存 */
+	mmempool_resource(void *mem_ptr, uint32_t mem_size, uint32_t order_min, uint32_t order_max,
+			  uint32_t flags = default_flags,
+			  std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+		: upstream_(upstream)
+	{
+		pool_ = mmempool_create_ex(mem_ptr, mem_size, order_min, order_max, flags);
+		if (!pool_)
+			throw std::bad_alloc();
+		/* 最大chunk减去chunk头部和red zone */
+		max_bytes_ = (static_cast<std::size_t>(1) << (order_max + 10)) - mmempool_overhead(pool_);
+	}
+
+	mmempool_resource(const mmempool_resource &) = delete;
+	mmempool_resource &operator=(const mmempool_resource &) = delete;
+
+	~mmempool_resource() override
+	{
+		mmempool_destroy(pool_);
+	}
+
+	mmempool_t *pool() const { return pool_; }
+	std::pmr::memory_resource *upstream_resource() const { return upstream_; }
+
+	bool owns(const void *p) const
+	{
+		return static_cast<const char *>(p) >= static_cast<const char *>(pool_->mmem) &&
+		       static_cast<const char *>(p) < static_cast<const char *>(pool_->mmem) + pool_->mem_size;
+	}
+
+private:
+	void *do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		void *p;
+
+		if (bytes <= max_bytes_) {
+			if (alignment <= MMEMPOOL_ALIGN)
+				p = mmempool_alloc(pool_, bytes ? static_cast<uint32_t>(bytes) : 1);
+			else
+				p = mmempool_alloc_aligned(pool_, static_cast<uint32_t>(bytes),
+							   static_cast<uint32_t>(alignment));
+			if (p)
+				return p;
+		}
+		return upstream_->allocate(bytes, alignment);
+	}
+
+	void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+	{
+		if (owns(p)) {
+			mmempool_free(pool_, p);
+			return;
+		}
+		upstream_->deallocate(p, bytes, alignment);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+
+	mmempool_t *pool_;
+	std::pmr::memory_resource *upstream_;
+	std::size_t max_bytes_;
+};
+
+} /* namespace mempool */
+
+#endif
@@ -0,0 +1,352 @@
+/*
+ * Typed memory pool, header only C++ version of smempool.
+ *
+ * Author: ForeverCai <gdzhforever@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ */
+#ifndef __TYPED_POOL_HPP_
+#define __TYPED_POOL_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <type_traits>
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif
+
+/*
+ * 与smempool相同的布局, 元素大小/个数在编译期确定:
+ *
+ *	+--------------------------------------+
+ *      |         |            | |    |        |
+ *      |  header | smem_bufctl| |ele0|......  |
+ *      |         |            | |    |        |
+ *	+--------------------------------------+
+ *
+ * 纯头文件, 不链接mempool.c, 只共用布局.
+ * 空闲链表为下标链表, 分配/释放都是内联代码, 下标计算中的除法
+ * 除数为常量, 由编译器换成乘法或移位.
+ */
+namespace mempool {
+
+/* lock policies */
+struct null_lock {
+	void lock() {}
+	void unlock() {}
+};
+
+struct spin_lock {
+	std::atomic_flag flag = ATOMIC_FLAG_INIT;
+
+	void lock()
+	{
+		while (flag.test_and_set(std::memory_order_acquire))
+			;
+	}
+	void unlock() { flag.clear(std::memory_order_release); }
+};
+
+struct mutex_lock {
+	std::mutex mutex;
+
+	void lock() { mutex.lock(); }
+	void unlock() { mutex.unlock(); }
+};
+
+template <typename T, std::size_t Align = alignof(T), typename LockPolicy = spin_lock,
+	  std::size_t MemSize = 64 * 1024>
+class typed_pool {
+public:
+	typedef uint32_t bufctl_t;
+
+	/* 同SMEM_BUFCTL_INUSE, 分配出去的元素的bufctl, 用于检查重复释放 */
+	static constexpr bufctl_t bufctl_inuse = static_cast<bufctl_t>(-1);
+
+	static_assert(Align && !(Align & (Align - 1)), "Align must be a power of two");
+	static_assert(Align >= alignof(T), "Align is smaller than alignof(T)");
+
+	static constexpr std::size_t align = Align;
+	static constexpr std::size_t mem_size = MemSize;
+	static constexpr std::size_t ele_ssize = sizeof(T);	/* element source size */
+	static constexpr std::size_t ele_asize = (sizeof(T) + Align - 1) & ~(Align - 1);	/* element adjust size */
+
+private:
+	struct header {
+		bufctl_t free;
+		uint32_t inuse;
+	};
+
+	static constexpr std::size_t align_up(std::size_t n, std::size_t a)
+	{
+		return (n + a - 1) & ~(a - 1);
+	}
+
+	/* 元素区起始偏移: header和bufctl之后按Align对齐 */
+	static constexpr std::size_t smem_off_for(std::size_t n)
+	{
+		return align_up(sizeof(header) + n * sizeof(bufctl_t), Align);
+	}
+
+	static constexpr std::size_t calc_ele_num()
+	{
+		std::size_t n = MemSize > sizeof(header) ?
+			(MemSize - sizeof(header)) / (sizeof(bufctl_t) + ele_asize) : 0;
+
+		while (n && smem_off_for(n) + n * ele_asize > MemSize)
+			n--;
+		return n;
+	}
+
+public:
+	static constexpr std::size_t ele_num = calc_ele_num();
+	static constexpr std::size_t smem_off = smem_off_for(ele_num);
+
+	static_assert(ele_num > 0, "MemSize too small for one element");
+	static_assert(ele_num < bufctl_inuse, "too many elements");
+
+	/* 内存由pool申请 */
+	typed_pool() : mem_(static_cast<char *>(::operator new(MemSize, std::align_val_t(Align)))), owned_(true)
+	{
+		init();
+	}
+
+	/* 使用调用者的内存, 至少MemSize字节, 按Align对齐 */
+	explicit typed_pool(void *mem_ptr) : mem_(static_cast<char *>(mem_ptr)), owned_(false)
+	{
+		init();
+	}
+
+	typed_pool(const typed_pool &) = delete;
+	typed_pool &operator=(const typed_pool &) = delete;
+
+	~typed_pool()
+	{
+		if (owned_)
+			::operator delete(mem_, std::align_val_t(Align));
+	}
+
+	/* 未构造的元素, 用完返回nullptr */
+	T *allocate()
+	{
+		bufctl_t objnr;
+
+		lock_.lock();
+		if (hdr()->inuse == ele_num) {
+			lock_.unlock();
+			return nullptr;
+		}
+		objnr = hdr()->free;
+		hdr()->free = bufctl()[objnr];
+		bufctl()[objnr] = bufctl_inuse;
+		hdr()->inuse++;
+		lock_.unlock();
+
+		return index_to_obj(objnr);
+	}
+
+	/* 不属于pool, 未对齐到元素或重复释放的指针被忽略 */
+	void deallocate(T *objp)
+	{
+		bufctl_t objnr;
+
+		if (!objp || !owns(objp) ||
+		    (reinterpret_cast<const char *>(objp) - (mem_ + smem_off)) % ele_asize)
+			return;
+		objnr = obj_to_index(objp);
+		lock_.lock();
+		if (bufctl()[objnr] != bufctl_inuse) {
+			lock_.unlock();
+			return;
+		}
+		bufctl()[objnr] = hdr()->free;
+		hdr()->free = objnr;
+		hdr()->inuse--;
+		lock_.unlock();
+	}
+
+	template <typename... Args>
+	T *create(Args &&...args)
+	{
+		T *objp = allocate();
+
+		if (!objp)
+			return nullptr;
+		try {
+			return ::new (static_cast<void *>(objp)) T(std::forward<Args>(args)...);
+		} catch (...) {
+			deallocate(objp);
+			throw;
+		}
+	}
+
+	void destroy(T *objp)
+	{
+		if (!objp)
+			return;
+		objp->~T();
+		deallocate(objp);
+	}
+
+	bool owns(const void *p) const
+	{
+		return static_cast<const char *>(p) >= mem_ + smem_off &&
+		       static_cast<const char *>(p) < mem_ + smem_off + ele_num * ele_asize;
+	}
+
+	std::size_t inuse() const { return hdr()->inuse; }
+	static constexpr std::size_t capacity() { return ele_num; }
+
+private:
+	header *hdr() const { return reinterpret_cast<header *>(mem_); }
+	bufctl_t *bufctl() const { return reinterpret_cast<bufctl_t *>(mem_ + sizeof(header)); }
+
+	T *index_to_obj(bufctl_t idx) const
+	{
+		return reinterpret_cast<T *>(mem_ + smem_off + ele_asize * idx);
+	}
+
+	bufctl_t obj_to_index(const T *objp) const
+	{
+		return static_cast<bufctl_t>((reinterpret_cast<const char *>(objp) - (mem_ + smem_off)) / ele_asize);
+	}
+
+	void init()
+	{
+		std::size_t i;
+
+		hdr()->free = 0;
+		hdr()->inuse = 0;
+		for (i = 0; i < ele_num; i++)
+			bufctl()[i] = static_cast<bufctl_t>(i + 1);
+	}
+
+	char *mem_;
+	bool owned_;
+	LockPolicy lock_;
+};
+
+/*
+ * std::allocator兼容的适配器: 单个对象从每个类型一个的全局typed_pool分配,
+ * 数组或pool用完时退回到operator new. 适合std::list/std::map等节点容器,
+ * rebind后的节点类型有各自的pool.
+ */
+template <typename T, std::size_t Align = alignof(T), typename LockPolicy = spin_lock,
+	  std::size_t MemSize = 64 * 1024>
+class pool_allocator {
+public:
+	typedef T value_type;
+	typedef typed_pool<T, (Align > alignof(T) ? Align : alignof(T)), LockPolicy, MemSize> pool_type;
+
+	template <typename U>
+	struct rebind {
+		typedef pool_allocator<U, Align, LockPolicy, MemSize> other;
+	};
+
+	pool_allocator() noexcept = default;
+	template <typename U>
+	pool_allocator(const pool_allocator<U, Align, LockPolicy, MemSize> &) noexcept {}
+
+	/*
+	 * 有意不析构: 静态对象中的容器可能在本pool之后析构,
+	 * 那时仍要归还节点
+	 */
+	static pool_type &pool()
+	{
+		static pool_type *instance = new pool_type;
+		return *instance;
+	}
+
+	T *allocate(std::size_t n)
+	{
+		T *objp;
+
+		if (n == 1) {
+			objp = pool().allocate();
+			if (objp)
+				return objp;
+		}
+		return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(pool_type::align)));
+	}
+
+	void deallocate(T *objp, std::size_t n) noexcept
+	{
+		if (n == 1 && pool().owns(objp)) {
+			pool().deallocate(objp);
+			return;
+		}
+		::operator delete(objp, std::align_val_t(pool_type::align));
+	}
+};
+
+template <typename T, typename U, std::size_t A, typename L, std::size_t M>
+bool operator==(const pool_allocator<T, A, L, M> &, const pool_allocator<U, A, L, M> &) noexcept
+{
+	return true;
+}
+
+template <typename T, typename U, std::size_t A, typename L, std::size_t M>
+bool operator!=(const pool_allocator<T, A, L, M> &, const pool_allocator<U, A, L, M> &) noexcept
+{
+	return false;
+}
+
+#if defined(__cpp_lib_memory_resource)
+/*
+ * pmr适配器: 不超过一个元素大小且对齐满足的请求从typed_pool分配,
+ * 其余交给upstream
+ */
+template <typename T, std::size_t Align = alignof(T), typename LockPolicy = spin_lock,
+	  std::size_t MemSize = 64 * 1024>
+class pool_resource : public std::pmr::memory_resource {
+public:
+	typedef typed_pool<T, Align, LockPolicy, MemSize> pool_type;
+
+	explicit pool_resource(std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+		: upstream_(upstream) {}
+
+	pool_type &pool() { return pool_; }
+
+private:
+	void *do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		void *p;
+
+		if (bytes <= pool_type::ele_asize && alignment <= pool_type::align) {
+			p = pool_.allocate();
+			if (p)
+				return p;
+		}
+		return upstream_->allocate(bytes, alignment);
+	}
+
+	void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+	{
+		if (pool_.owns(p)) {
+			pool_.deallocate(static_cast<T *>(p));
+			return;
+		}
+		upstream_->deallocate(p, bytes, alignment);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+
+	std::pmr::memory_resource *upstream_;
+	pool_type pool_;
+};
+#endif
+
+} /* namespace mempool */
+
+#endif